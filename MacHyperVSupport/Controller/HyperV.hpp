@@ -618,6 +618,13 @@ typedef struct {
 #define kHyperVEventFlagsByteCount  256
 #define kHyperVEventFlagsDwordCount (kHyperVEventFlagsByteCount / sizeof (UInt32))
 
+//
+// Event flags are scanned a native machine word at a time.
+//
+typedef unsigned long HyperVEventFlagsWord;
+#define kHyperVEventFlagsWordBits   (sizeof (HyperVEventFlagsWord) * 8)
+#define kHyperVEventFlagsWordCount  (kHyperVEventFlagsByteCount / sizeof (HyperVEventFlagsWord))
+
 //
 // Event flags.
 //
@@ -625,6 +632,7 @@ typedef struct __attribute__((packed)) {
   union {
     UInt8   flags8[kHyperVEventFlagsByteCount];
     UInt32  flags32[kHyperVEventFlagsDwordCount];
+    HyperVEventFlagsWord flagsWord[kHyperVEventFlagsWordCount];
   };
 } HyperVEventFlags;
 
@@ -634,23 +642,63 @@ typedef struct __attribute__((packed)) {
   UInt16 reserved;
 } HyperVMonitorNotificationParameter;
 
+//
+// Monitored notification page.
+// Guests set a pending bit in a trigger group instead of a hypercall, and Hyper-V polls the page.
+//
+#define kHyperVMonitorTriggerGroupCount   4
+#define kHyperVMonitorTriggerGroupBits    32
+#define kHyperVMonitorMaxId               (kHyperVMonitorTriggerGroupCount * kHyperVMonitorTriggerGroupBits)
+
+typedef struct __attribute__((packed)) {
+  UInt32 pending;
+  UInt32 armed;
+} HyperVMonitorTriggerGroup;
+
+typedef struct __attribute__((packed)) {
+  UInt32                              triggerState;
+  UInt32                              reserved1;
+  HyperVMonitorTriggerGroup           triggerGroups[kHyperVMonitorTriggerGroupCount];
+  UInt64                              reserved2[3];
+  SInt32                              nextCheckTime[kHyperVMonitorTriggerGroupCount][kHyperVMonitorTriggerGroupBits];
+  UInt16                              latency[kHyperVMonitorTriggerGroupCount][kHyperVMonitorTriggerGroupBits];
+  UInt64                              reserved3[32];
+  HyperVMonitorNotificationParameter  parameters[kHyperVMonitorTriggerGroupCount][kHyperVMonitorTriggerGroupBits];
+  UInt8                               reserved4[1984];
+} HyperVMonitorPage;
+static_assert(sizeof (HyperVMonitorPage) == PAGE_SIZE, "Monitor page must be a single page");
+
 //
 // DMA buffer structure.
+// Physical address is only valid for the entire buffer if it was allocated as contiguous.
+// Buffers taken from a slab have no memory descriptor of their own.
 //
+typedef struct HyperVDMASlabEntry HyperVDMASlabEntry;
+
 typedef struct {
   IOBufferMemoryDescriptor  *bufDesc;
   IODMACommand              *dmaCmd;
   mach_vm_address_t         physAddr;
   UInt8                     *buffer;
   size_t                    size;
+  HyperVDMASlabEntry        *slabEntry;
 } HyperVDMABuffer;
 
+//
+// DMA buffer allocation options.
+//
+enum {
+  kHyperVDMABufferOptionNonContiguous = (1 << 0),
+  kHyperVDMABufferOptionNoZero        = (1 << 1)
+};
+
 //
 // XNU CPU external functions/variables from mp.c.
 //
 extern unsigned int real_ncpus;    /* real number of cpus */
 extern "C" {
   int cpu_number(void);
+  void mp_rendezvous_no_intrs(void (*action_func)(void*), void *arg);
 }
 
 #endif
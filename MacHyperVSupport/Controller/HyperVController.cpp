@@ -37,6 +37,11 @@ bool HyperVController::start(IOService *provider) {
     return false;
   }
   
+  //
+  // Timeline is optional, boot continues without it.
+  //
+  initTimeline();
+
   bool result = false;
   do {
     //
@@ -46,6 +51,11 @@ bool HyperVController::start(IOService *provider) {
       HVSYSLOG("This system is not Hyper-V, aborting...");
       break;
     }
+
+    //
+    // Reference counter availability is only known once Hyper-V is identified.
+    //
+    recordTimeline(0, kHyperVTimelinePhaseControllerStart, kHyperVTimelineEventBegin);
     
     //
     // Disable I/O mapper.
@@ -86,16 +96,23 @@ bool HyperVController::start(IOService *provider) {
     HVDBGLOG("HyperVPCIRoot is now loaded");
     
     //
-    // Setup hypercalls and interrupts.
+    // Setup DMA buffer slabs, hypercalls, and interrupts.
     //
+    if (!initDmaSlabs()) {
+      break;
+    }
+    recordTimeline(0, kHyperVTimelinePhaseHypercallInit, kHyperVTimelineEventBegin);
     if (!initHypercalls()) {
       HVSYSLOG("Failed to initialize hypercalls");
       break;
     }
+    recordTimeline(0, kHyperVTimelinePhaseHypercallInit, kHyperVTimelineEventEnd);
+    recordTimeline(0, kHyperVTimelinePhaseInterruptInit, kHyperVTimelineEventBegin);
     if (!initInterrupts()) {
       HVSYSLOG("Failed to initialize interrupts");
       break;
     }
+    recordTimeline(0, kHyperVTimelinePhaseInterruptInit, kHyperVTimelineEventEnd);
     
     //
     // Initialize VMBus root.
@@ -109,6 +126,7 @@ bool HyperVController::start(IOService *provider) {
     result = true;
   } while (false);
   
+  recordTimeline(0, kHyperVTimelinePhaseControllerStart, result ? kHyperVTimelineEventEnd : kHyperVTimelineEventFailed);
   if (!result) {
     super::stop(provider);
   }
@@ -149,6 +167,11 @@ bool HyperVController::identifyHyperV() {
   _hvFeatures   = regs[eax];
   _hvPmFeatures = regs[ecx];
   _hvFeatures3  = regs[edx];
+
+  //
+  // VP index is required to target channel interrupts at specific CPUs.
+  //
+  _supportsHvVpIndex = (_hvFeatures & kHyperVCpuidMsrVPIndex) != 0;
   
   //
   // Spec indicates we are supposed to indicate to Hyper-V what OS we are
@@ -259,41 +282,6 @@ bool HyperVController::initVMBus() {
   return true;
 }
 
-bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size) {
-  IOBufferMemoryDescriptor *bufDesc;
-  
-  //
-  // Create page-aligned DMA buffer and get physical address.
-  //
-  bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
-                                                             kIODirectionInOut | kIOMemoryPhysicallyContiguous,
-                                                             size, 0xFFFFFFFFFFFFF000ULL);
-  if (bufDesc == nullptr) {
-    HVSYSLOG("Failed to allocate DMA buffer memory of %u bytes", size);
-    return false;
-  }
-  bufDesc->prepare();
-  
-  dmaBuf->bufDesc  = bufDesc;
-  dmaBuf->physAddr = bufDesc->getPhysicalAddress();
-  dmaBuf->buffer   = (UInt8*) bufDesc->getBytesNoCopy();
-  dmaBuf->size     = size;
-  
-  memset(dmaBuf->buffer, 0, dmaBuf->size);
-  HVDBGLOG("Mapped buffer of %u bytes to 0x%llX", dmaBuf->size, dmaBuf->physAddr);
-  return true;
-}
-
-void HyperVController::freeDmaBuffer(HyperVDMABuffer *dmaBuf) {
-  IOBufferMemoryDescriptor *bufDesc = dmaBuf->bufDesc;
-
-  bzero(dmaBuf, sizeof (*dmaBuf));
-  if (bufDesc != nullptr) {
-    bufDesc->complete();
-    OSSafeReleaseNULL(bufDesc);
-  }
-}
-
 bool HyperVController::addInterruptProperties(OSDictionary *dict, UInt32 interruptVector) {
   //
   // Create interrupt specifier dictionary.
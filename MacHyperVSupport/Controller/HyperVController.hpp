@@ -12,11 +12,11 @@
 #include <IOKit/IOService.h>
 
 #include "HyperV.hpp"
+#include "HyperVTimeline.hpp"
 
 extern "C" {
 #include <i386/cpuid.h>
 #include <i386/proc_reg.h>
-#include <i386/pmCPU.h>
 }
 
 typedef struct {
@@ -35,6 +35,28 @@ typedef struct {
   HyperVDMABuffer         postMessageDma;
 } HyperVCPUData;
 
+//
+// DMA buffer slabs.
+// Contiguous buffers of up to 8 pages are carved out of 64KB chunks, and reused once freed.
+//
+#define kHyperVDMASlabClassCount  4
+#define kHyperVDMASlabChunkSize   (PAGE_SIZE * 16)
+
+struct HyperVDMASlabEntry {
+  HyperVDMASlabEntry  *next;
+  UInt8               *buffer;
+  mach_vm_address_t   physAddr;
+  UInt32              slabClass;
+  bool                dirty;
+};
+
+typedef struct {
+  HyperVDMASlabEntry  *freeList;
+  UInt32              entrySize;
+  UInt32              totalCount;
+  UInt32              freeCount;
+} HyperVDMASlab;
+
 class HyperVInterruptController;
 class HyperVVMBus;
 class HyperVUserClient;
@@ -55,11 +77,6 @@ private:
   UInt16 _hvMajorVersion = 0;
   UInt32 _hvRecommends   = 0;
   
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
-  pmCallBacks_t _pmCallbacks     = { };
-  IOSimpleLock  *_preemptionLock = nullptr;
-#endif
-  
   //
   // Hypercall page.
   //
@@ -79,12 +96,28 @@ private:
   HyperVInterruptController *_hvInterruptController = nullptr;
   HyperVVMBus               *_hvVMBus               = nullptr;
   HyperVUserClient          *_userClientInstance    = nullptr;
+
+  //
+  // DMA buffer slabs.
+  //
+  IOLock            *_dmaSlabLock = nullptr;
+  HyperVDMASlab     _dmaSlabs[kHyperVDMASlabClassCount] = { };
+
+  //
+  // Boot timeline.
+  //
+  HyperVTimelineRecord  *_timelineRecords = nullptr;
+  volatile UInt32       _timelineCount    = 0;
   
   //
   // Misc functions.
   //
   bool identifyHyperV();
   bool initVMBus();
+  bool initDmaSlabs();
+  bool growDmaSlab(UInt32 slabClass);
+  bool initTimeline();
+  UInt64 getTimelineTimestamp();
   
   //
   // Hypercalls/interrupts.
@@ -96,17 +129,19 @@ private:
   bool initInterrupts();
   void destroySynIC();
   void handleInterrupt(OSObject *target, void *refCon, IOService *nub, int source);
+  void handleEventFlags(volatile HyperVEventFlags *eventFlags);
   
 public:
   //
   // IOService overrides.
   //
   bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
   
   //
   // Misc functions.
   //
-  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size);
+  bool allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, IOOptionBits options = 0);
   void freeDmaBuffer(HyperVDMABuffer *dmaBuf);
   bool addInterruptProperties(OSDictionary *dict, UInt32 interruptVector);
   
@@ -117,14 +152,27 @@ public:
   HypercallStatus hypercallSignalEvent(UInt32 connectionId);
   bool enableInterrupts(HyperVEventFlags *legacyEventFlags = nullptr);
   void disableInterrupts();
-  void sendSynICEOM(UInt32 cpu);
   
+  //
+  // CPU information.
+  // Hyper-V identifies CPUs by virtual processor index, which may not match the XNU CPU number.
+  //
+  inline UInt32 getCPUCount() { return _cpuDataCount; }
+  inline bool isVirtualCPUIndexSupported() { return _supportsHvVpIndex; }
+  inline UInt32 getVirtualCPUIndex(UInt32 cpu) { return (UInt32) _cpuData[cpu].virtualCPUIndex; }
+
   //
   // Time reference counter.
   //
   inline bool isTimeRefCounterSupported() { return (_hvFeatures & kHyperVCpuidMsrTimeRefCnt); }
   inline UInt64 readTimeRefCounter() { return isTimeRefCounterSupported() ? rdmsr64(kHyperVMsrTimeRefCount) : 0; }
 
+  //
+  // Boot timeline.
+  //
+  void recordTimeline(UInt32 channelId, HyperVTimelinePhase phase, HyperVTimelineEvent event);
+  bool getTimelinePhase(UInt32 channelId, HyperVTimelinePhase phase, UInt64 *begin, UInt64 *end) const;
+
   //
   // Messages.
   //
@@ -134,6 +182,20 @@ public:
   inline void clearPendingMessage(UInt32 cpuIndex, UInt32 messageIndex) {
     _cpuData[cpuIndex].messages[messageIndex].type = kHyperVMessageTypeNone;
   }
+
+  //
+  // Frees the message slot and signals end-of-message if Hyper-V has another message waiting.
+  // Must be called on the CPU that received the message, with interrupts disabled.
+  //
+  inline void completePendingMessage(UInt32 cpuIndex, UInt32 messageIndex) {
+    HyperVMessage *message = &_cpuData[cpuIndex].messages[messageIndex];
+
+    message->type = kHyperVMessageTypeNone;
+    __sync_synchronize();
+    if (message->flags.messagePending) {
+      wrmsr64(kHyperVMsrEom, 0);
+    }
+  }
 };
 
 #endif
@@ -0,0 +1,173 @@
+//
+//  HyperVControllerDMA.cpp
+//  Hyper-V DMA buffer allocation
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+
+bool HyperVController::initDmaSlabs() {
+  _dmaSlabLock = IOLockAlloc();
+  if (_dmaSlabLock == nullptr) {
+    HVSYSLOG("Failed to allocate DMA slab lock");
+    return false;
+  }
+
+  //
+  // Each size class holds buffers of a power of two number of pages.
+  //
+  for (UInt32 i = 0; i < kHyperVDMASlabClassCount; i++) {
+    _dmaSlabs[i].freeList   = nullptr;
+    _dmaSlabs[i].entrySize  = PAGE_SIZE << i;
+    _dmaSlabs[i].totalCount = 0;
+    _dmaSlabs[i].freeCount  = 0;
+  }
+  return true;
+}
+
+bool HyperVController::growDmaSlab(UInt32 slabClass) {
+  IOBufferMemoryDescriptor  *bufDesc;
+  HyperVDMASlab             *slab = &_dmaSlabs[slabClass];
+  HyperVDMASlabEntry        *entries;
+  mach_vm_address_t         physAddr;
+  UInt8                     *buffer;
+  UInt32                    entryCount;
+
+  //
+  // Carve a single physically contiguous chunk into buffers of this size class.
+  // Chunks are never returned to the system, buffers freed back to the slab are reused instead.
+  //
+  entryCount = kHyperVDMASlabChunkSize / slab->entrySize;
+  entries    = IONew(HyperVDMASlabEntry, entryCount);
+  if (entries == nullptr) {
+    HVSYSLOG("Failed to allocate DMA slab entries");
+    return false;
+  }
+
+  bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+                                                             kIODirectionInOut | kIOMemoryPhysicallyContiguous,
+                                                             kHyperVDMASlabChunkSize, 0xFFFFFFFFFFFFF000ULL);
+  if (bufDesc == nullptr) {
+    HVSYSLOG("Failed to allocate DMA slab chunk of %u bytes", kHyperVDMASlabChunkSize);
+    IODelete(entries, HyperVDMASlabEntry, entryCount);
+    return false;
+  }
+  bufDesc->prepare();
+
+  physAddr = bufDesc->getPhysicalAddress();
+  buffer   = (UInt8*) bufDesc->getBytesNoCopy();
+  memset(buffer, 0, kHyperVDMASlabChunkSize);
+
+  for (UInt32 i = 0; i < entryCount; i++) {
+    entries[i].buffer    = buffer + (i * slab->entrySize);
+    entries[i].physAddr  = physAddr + (i * slab->entrySize);
+    entries[i].slabClass = slabClass;
+    entries[i].dirty     = false;
+    entries[i].next      = slab->freeList;
+    slab->freeList       = &entries[i];
+  }
+  slab->totalCount += entryCount;
+  slab->freeCount  += entryCount;
+
+  HVDBGLOG("Added %u buffers of %u bytes to DMA slab at 0x%llX", entryCount, slab->entrySize, physAddr);
+  return true;
+}
+
+bool HyperVController::allocateDmaBuffer(HyperVDMABuffer *dmaBuf, size_t size, IOOptionBits options) {
+  IOBufferMemoryDescriptor  *bufDesc;
+  IOOptionBits              bufOptions = kIODirectionInOut;
+  HyperVDMASlabEntry        *entry     = nullptr;
+  UInt32                    slabClass;
+
+  //
+  // Smaller contiguous buffers are taken from the slab for their size class.
+  //
+  if (!(options & kHyperVDMABufferOptionNonContiguous) && size <= (PAGE_SIZE << (kHyperVDMASlabClassCount - 1))) {
+    slabClass = 0;
+    while ((PAGE_SIZE << slabClass) < size) {
+      slabClass++;
+    }
+
+    IOLockLock(_dmaSlabLock);
+    if (_dmaSlabs[slabClass].freeList != nullptr || growDmaSlab(slabClass)) {
+      entry                         = _dmaSlabs[slabClass].freeList;
+      _dmaSlabs[slabClass].freeList = entry->next;
+      _dmaSlabs[slabClass].freeCount--;
+    }
+    IOLockUnlock(_dmaSlabLock);
+
+    if (entry == nullptr) {
+      return false;
+    }
+
+    //
+    // Buffers are zeroed when reused, fresh slab memory is already zeroed.
+    //
+    if (entry->dirty && !(options & kHyperVDMABufferOptionNoZero)) {
+      memset(entry->buffer, 0, size);
+    }
+    entry->next = nullptr;
+
+    dmaBuf->bufDesc   = nullptr;
+    dmaBuf->dmaCmd    = nullptr;
+    dmaBuf->physAddr  = entry->physAddr;
+    dmaBuf->buffer    = entry->buffer;
+    dmaBuf->size      = size;
+    dmaBuf->slabEntry = entry;
+    return true;
+  }
+
+  //
+  // Large buffers that are only shared with Hyper-V through a GPADL do not need to be physically contiguous,
+  // and can be allocated from regular wired memory. The physical address is then only that of the first page.
+  //
+  if (!(options & kHyperVDMABufferOptionNonContiguous)) {
+    bufOptions |= kIOMemoryPhysicallyContiguous;
+  }
+  
+  //
+  // Create page-aligned DMA buffer and get physical address.
+  //
+  bufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, bufOptions, size, 0xFFFFFFFFFFFFF000ULL);
+  if (bufDesc == nullptr) {
+    HVSYSLOG("Failed to allocate DMA buffer memory of %u bytes", size);
+    return false;
+  }
+  bufDesc->prepare();
+  
+  dmaBuf->bufDesc   = bufDesc;
+  dmaBuf->dmaCmd    = nullptr;
+  dmaBuf->physAddr  = bufDesc->getPhysicalAddress();
+  dmaBuf->buffer    = (UInt8*) bufDesc->getBytesNoCopy();
+  dmaBuf->size      = size;
+  dmaBuf->slabEntry = nullptr;
+  
+  if (!(options & kHyperVDMABufferOptionNoZero)) {
+    memset(dmaBuf->buffer, 0, dmaBuf->size);
+  }
+  HVDBGLOG("Mapped %scontiguous buffer of %u bytes to 0x%llX",
+           (options & kHyperVDMABufferOptionNonContiguous) ? "non-" : "", dmaBuf->size, dmaBuf->physAddr);
+  return true;
+}
+
+void HyperVController::freeDmaBuffer(HyperVDMABuffer *dmaBuf) {
+  IOBufferMemoryDescriptor  *bufDesc = dmaBuf->bufDesc;
+  HyperVDMASlabEntry        *entry   = dmaBuf->slabEntry;
+
+  //
+  // DMA buffer structure may be stored within the buffer itself, clear it before releasing.
+  //
+  bzero(dmaBuf, sizeof (*dmaBuf));
+  if (entry != nullptr) {
+    IOLockLock(_dmaSlabLock);
+    entry->dirty                           = true;
+    entry->next                            = _dmaSlabs[entry->slabClass].freeList;
+    _dmaSlabs[entry->slabClass].freeList   = entry;
+    _dmaSlabs[entry->slabClass].freeCount++;
+    IOLockUnlock(_dmaSlabLock);
+  } else if (bufDesc != nullptr) {
+    bufDesc->complete();
+    OSSafeReleaseNULL(bufDesc);
+  }
+}
@@ -9,42 +9,6 @@
 #include "HyperVInterruptController.hpp"
 #include "VMBus.hpp"
 
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
-//
-// PM versions.
-//
-// Versions 10.7.0 and above are all the same 102.
-//
-#define kPMDispatchVersion10_6_0    17
-#define kPMDispatchVersion10_6_1    17
-#define kPMDispatchVersion10_6_2    18
-#define kPMDispatchVersion10_6_3    19
-#define kPMDispatchVersion10_6_4    20
-#define kPMDispatchVersion10_6_5    21
-#define kPMDispatchVersion10_6_6    21
-#define kPMDispatchVersion10_6_7    21
-#define kPMDispatchVersion10_6_8    23
-
-static UInt32 pmVersionsSnowLeopard[] = {
-  kPMDispatchVersion10_6_0,
-  kPMDispatchVersion10_6_1,
-  kPMDispatchVersion10_6_2,
-  kPMDispatchVersion10_6_3,
-  kPMDispatchVersion10_6_4,
-  kPMDispatchVersion10_6_5,
-  kPMDispatchVersion10_6_6,
-  kPMDispatchVersion10_6_7,
-  kPMDispatchVersion10_6_8
-};
-#endif
-
-//
-// External functions from mp.c
-//
-extern "C" {
-  void mp_rendezvous_no_intrs(void (*action_func)(void*), void *arg);
-}
-
 extern "C" void initCPUSyncIC(void *cpuData) {
   HyperVCPUData *hvCPUData = &(static_cast<HyperVCPUData*>(cpuData)[cpu_number()]);
 
@@ -83,17 +47,6 @@ extern "C" void initCPUSyncIC(void *cpuData) {
   wrmsr64(kHyperVMsrSyncICControl, kHyperVMsrSyncICControlEnable | (rdmsr64(kHyperVMsrSyncICControl) & kHyperVMsrSyncICControlRsvdMask));
 }
 
-#if __MAC_OS_X_VERSION_MIN_REQUIRED < __MAC_10_6
-extern "C" void doAllCpuSyncICEOM(void *cpu) {
-  int currentCpuIndex  = cpu_number();
-  int *desiredCpuIndex = (int*)cpu;
-
-  if (currentCpuIndex == *desiredCpuIndex) {
-    wrmsr64(kHyperVMsrEom, 0);
-  }
-}
-#endif
-
 bool HyperVController::allocateInterruptBuffers() {
   //
   // Allocate per-CPU buffers.
@@ -180,28 +133,6 @@ bool HyperVController::initInterrupts() {
   _interruptVector = vector;
   HVDBGLOG("VMBus device interrupt vector: 0x%X", _interruptVector);
 
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
-  //
-  // Get PM callbacks.
-  //
-  UInt32 pmVersion = PM_DISPATCH_VERSION;
-  if (getKernelVersion() == KernelVersion::SnowLeopard) {
-    if (getKernelMinorVersion() < arrsize(pmVersionsSnowLeopard)) {
-      pmVersion = pmVersionsSnowLeopard[getKernelMinorVersion()];
-    }
-  }
-
-  pmKextRegister(pmVersion, NULL, &_pmCallbacks);
-  if (_pmCallbacks.LCPUtoProcessor == nullptr || _pmCallbacks.ThreadBind == nullptr) {
-    HVSYSLOG("PM callbacks are invalid");
-    return false;
-  }
-  _preemptionLock = IOSimpleLockAlloc();
-  if (_preemptionLock == nullptr) {
-    return false;
-  }
-#endif
-
   //
   // Allocate buffers for interrupts.
   //
@@ -246,11 +177,7 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
   //
   message = getPendingMessage(cpuIndex, kVMBusInterruptTimer);
   if (message->type == kHyperVMessageTypeTimerExpired) {
-    message->type = kHyperVMessageTypeNone;
-
-    if (message->flags.messagePending) {
-      wrmsr64(kHyperVMsrEom, 0);
-    }
+    completePendingMessage(cpuIndex, kVMBusInterruptTimer);
   }
 
   //
@@ -260,24 +187,12 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
   // On Windows Server 2008 R2 and older, both the global event flags and the RX event flags need to be checked.
   // On Windows 8/Server 2012 and newer, each channel has its own bit in the global event flags.
   //
-  if (_useLegacyEventFlags && sync_test_and_clear_bit(0, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
-    //
-    // Check each channel for pending interrupt and invoke handler.
-    //
-    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
-      if (sync_test_and_clear_bit(i, _vmbusRxEventFlags->flags32)) {
-        _hvInterruptController->handleInterrupt(nullptr, nullptr, i);
-      }
+  if (_useLegacyEventFlags) {
+    if (sync_test_and_clear_bit(0, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
+      handleEventFlags(_vmbusRxEventFlags);
     }
   } else {
-    //
-    // Check each channel for pending interrupt and invoke handler.
-    //
-    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
-      if (sync_test_and_clear_bit(i, _cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage].flags32)) {
-        _hvInterruptController->handleInterrupt(nullptr, nullptr, i);
-      }
-    }
+    handleEventFlags(&_cpuData[cpuIndex].eventFlags[kVMBusInterruptMessage]);
   }
 
   //
@@ -289,6 +204,33 @@ void HyperVController::handleInterrupt(OSObject *target, void *refCon, IOService
   }
 }
 
+void HyperVController::handleEventFlags(volatile HyperVEventFlags *eventFlags) {
+  HyperVEventFlagsWord flags;
+  UInt32               channelId;
+
+  //
+  // Check each channel for pending interrupt and invoke handler.
+  //
+  // Each word is atomically swapped out with zero, only words with bits set are touched.
+  // Set bits are then walked from lowest to highest, channel 0 is not a valid channel.
+  //
+  for (UInt32 i = 0; i < kVMBusMaxChannels / kHyperVEventFlagsWordBits; i++) {
+    if (eventFlags->flagsWord[i] == 0) {
+      continue;
+    }
+
+    flags = __sync_lock_test_and_set(&eventFlags->flagsWord[i], 0);
+    while (flags != 0) {
+      channelId = (i * kHyperVEventFlagsWordBits) + __builtin_ctzl(flags);
+      flags &= flags - 1;
+
+      if (channelId != 0) {
+        _hvInterruptController->handleInterrupt(nullptr, nullptr, channelId);
+      }
+    }
+  }
+}
+
 bool HyperVController::enableInterrupts(HyperVEventFlags *legacyEventFlags) {
   disableInterrupts();
 
@@ -309,50 +251,3 @@ void HyperVController::disableInterrupts() {
   _useLegacyEventFlags = false;
   _vmbusRxEventFlags   = nullptr;
 }
-
-void HyperVController::sendSynICEOM(UInt32 cpu) {
-  //
-  // Only EOM if there is a pending message.
-  //
-  _cpuData[cpu].messages[kVMBusInterruptMessage].type = kHyperVMessageTypeNone;
-  if (!_cpuData[cpu].messages[kVMBusInterruptMessage].flags.messagePending) {
-    return;
-  }
-  
-#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
-  //
-  // Change to desired CPU if needed.
-  //
-  if (cpu != cpu_number()) {
-    if (!IOSimpleLockTryLock(_preemptionLock)) {
-      HVSYSLOG("Failed to disable preemption");
-      return;
-    }
-
-    bool intsEnabled = ml_set_interrupts_enabled(false);
-
-    do {
-      processor_t proc = _pmCallbacks.LCPUtoProcessor(cpu);
-      if (proc == nullptr) {
-        break;
-      }
-
-      _pmCallbacks.ThreadBind(proc);
-    } while (false);
-
-    IOSimpleLockUnlock(_preemptionLock);
-    ml_set_interrupts_enabled(intsEnabled);
-    HVDBGLOG("Changed to cpu %u", cpu_number());
-  }
-
-  //
-  // We should now be on the correct CPU, so send EOM.
-  //
-  wrmsr64(kHyperVMsrEom, 0);
-#else
-  //
-  // PM kext API does not exist on 10.4, call function on all CPUs.
-  //
-  mp_rendezvous_no_intrs(doAllCpuSyncICEOM, &cpu);
-#endif
-}
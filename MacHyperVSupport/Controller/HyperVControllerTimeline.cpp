@@ -0,0 +1,135 @@
+//
+//  HyperVControllerTimeline.cpp
+//  Hyper-V boot timeline instrumentation
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVController.hpp"
+
+bool HyperVController::initTimeline() {
+  _timelineRecords = IONew(HyperVTimelineRecord, kHyperVTimelineMaxRecords);
+  if (_timelineRecords == nullptr) {
+    HVSYSLOG("Failed to allocate boot timeline");
+    return false;
+  }
+  bzero(_timelineRecords, sizeof (HyperVTimelineRecord) * kHyperVTimelineMaxRecords);
+  return true;
+}
+
+UInt64 HyperVController::getTimelineTimestamp() {
+  UInt64 uptime;
+  UInt64 nanoseconds;
+
+  //
+  // Fall back to system uptime if the reference counter is not available.
+  //
+  if (isTimeRefCounterSupported()) {
+    return readTimeRefCounter();
+  }
+  clock_get_uptime(&uptime);
+  absolutetime_to_nanoseconds(uptime, &nanoseconds);
+  return nanoseconds / 100;
+}
+
+void HyperVController::recordTimeline(UInt32 channelId, HyperVTimelinePhase phase, HyperVTimelineEvent event) {
+  HyperVTimelineRecord *record;
+  UInt32               index;
+
+  if (_timelineRecords == nullptr) {
+    return;
+  }
+
+  //
+  // Records are only appended, once the timeline is full further records are counted as dropped.
+  //
+  index = OSIncrementAtomic(&_timelineCount);
+  if (index >= kHyperVTimelineMaxRecords) {
+    return;
+  }
+
+  record            = &_timelineRecords[index];
+  record->channelId = channelId;
+  record->phase     = phase;
+  record->event     = event;
+  record->cpu       = (UInt8) cpu_number();
+  record->timestamp = getTimelineTimestamp();
+}
+
+bool HyperVController::getTimelinePhase(UInt32 channelId, HyperVTimelinePhase phase, UInt64 *begin, UInt64 *end) const {
+  const HyperVTimelineRecord *record;
+  UInt32                     count;
+  bool                       foundBegin = false;
+  bool                       foundEnd   = false;
+
+  if (_timelineRecords == nullptr) {
+    return false;
+  }
+
+  //
+  // Use the last completed occurrence of the phase, instant events have the same begin and end.
+  //
+  count = (_timelineCount < kHyperVTimelineMaxRecords) ? _timelineCount : kHyperVTimelineMaxRecords;
+  for (UInt32 i = 0; i < count; i++) {
+    record = &_timelineRecords[i];
+    if (record->channelId != channelId || record->phase != phase || record->timestamp == 0) {
+      continue;
+    }
+
+    switch (record->event) {
+      case kHyperVTimelineEventBegin:
+        *begin     = record->timestamp;
+        foundBegin = true;
+        foundEnd   = false;
+        break;
+
+      case kHyperVTimelineEventEnd:
+      case kHyperVTimelineEventFailed:
+        *end     = record->timestamp;
+        foundEnd = foundBegin;
+        break;
+
+      case kHyperVTimelineEventInstant:
+        *begin     = record->timestamp;
+        *end       = record->timestamp;
+        foundBegin = true;
+        foundEnd   = true;
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  return foundBegin && foundEnd;
+}
+
+bool HyperVController::serializeProperties(OSSerialize *serialize) const {
+  HyperVTimelineHeader  header;
+  OSData                *timelineData;
+  UInt32                count;
+
+  //
+  // Timeline is only copied out when the I/O Registry is read.
+  //
+  if (_timelineRecords != nullptr) {
+    count = (_timelineCount < kHyperVTimelineMaxRecords) ? _timelineCount : kHyperVTimelineMaxRecords;
+
+    header.magic        = kHyperVTimelineMagic;
+    header.version      = kHyperVTimelineVersion;
+    header.recordSize   = sizeof (HyperVTimelineRecord);
+    header.recordCount  = count;
+    header.droppedCount = _timelineCount - count;
+
+    timelineData = OSData::withCapacity((UInt32) (sizeof (header) + (count * sizeof (HyperVTimelineRecord))));
+    if (timelineData != nullptr) {
+      if (timelineData->appendBytes(&header, sizeof (header))
+          && timelineData->appendBytes(_timelineRecords, count * sizeof (HyperVTimelineRecord))) {
+        const_cast<HyperVController*>(this)->setProperty(kHyperVTimelineKey, timelineData);
+      }
+      timelineData->release();
+    }
+  }
+
+  return super::serializeProperties(serialize);
+}
@@ -0,0 +1,85 @@
+//
+//  HyperVTimeline.hpp
+//  Hyper-V boot timeline record format
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVTimeline_hpp
+#define HyperVTimeline_hpp
+
+//
+// This header is freestanding and is shared between the kext and userspace tools.
+// It must not depend on IOKit or any other kernel-only headers.
+//
+#include <stdint.h>
+
+//
+// Timeline is published by HyperVController as a binary property, a header followed by records.
+// Timestamps are in 100ns units from the Hyper-V reference counter.
+//
+#define kHyperVTimelineKey          "HVBootTimeline"
+#define kHyperVTimelineMagic        0x4C545648 // 'HVTL'
+#define kHyperVTimelineVersion      1
+#define kHyperVTimelineMaxRecords   512
+
+typedef enum : uint16_t {
+  kHyperVTimelinePhaseInvalid           = 0,
+  kHyperVTimelinePhaseControllerStart   = 1,
+  kHyperVTimelinePhaseHypercallInit     = 2,
+  kHyperVTimelinePhaseInterruptInit     = 3,
+  kHyperVTimelinePhaseVMBusConnect      = 4,
+  kHyperVTimelinePhaseVMBusScan         = 5,
+  kHyperVTimelinePhaseChannelOffer      = 6,
+  kHyperVTimelinePhaseChannelOpen       = 7,
+  kHyperVTimelinePhaseGPADLCreate       = 8,
+  kHyperVTimelinePhaseProtocolHandshake = 9,
+  kHyperVTimelinePhaseDeviceReady       = 10,
+
+  kHyperVTimelinePhaseCount
+} HyperVTimelinePhase;
+
+typedef enum : uint8_t {
+  kHyperVTimelineEventBegin   = 0,
+  kHyperVTimelineEventEnd     = 1,
+  kHyperVTimelineEventFailed  = 2,
+  kHyperVTimelineEventInstant = 3
+} HyperVTimelineEvent;
+
+typedef struct __attribute__((packed)) {
+  uint32_t  magic;
+  uint16_t  version;
+  uint16_t  recordSize;
+  uint32_t  recordCount;
+  uint32_t  droppedCount;
+} HyperVTimelineHeader;
+
+//
+// Channel ID is 0 for bus-wide phases.
+//
+typedef struct __attribute__((packed)) {
+  uint64_t  timestamp;
+  uint32_t  channelId;
+  uint16_t  phase;
+  uint8_t   event;
+  uint8_t   cpu;
+} HyperVTimelineRecord;
+
+static inline const char *HyperVTimelinePhaseName(uint16_t phase) {
+  static const char *phaseNames[kHyperVTimelinePhaseCount] = {
+    "Invalid",
+    "ControllerStart",
+    "HypercallInit",
+    "InterruptInit",
+    "VMBusConnect",
+    "VMBusScan",
+    "ChannelOffer",
+    "ChannelOpen",
+    "GPADLCreate",
+    "ProtocolHandshake",
+    "DeviceReady"
+  };
+  return phase < kHyperVTimelinePhaseCount ? phaseNames[phase] : "Unknown";
+}
+
+#endif
@@ -21,6 +21,7 @@ protected:
   void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) APPLE_KEXT_OVERRIDE;
   UInt32 txBufferSize() APPLE_KEXT_OVERRIDE { return kHyperVFileCopyBufferSize; };
   UInt32 rxBufferSize() APPLE_KEXT_OVERRIDE { return kHyperVFileCopyBufferSize; };
+  bool openChannelOnDemand() APPLE_KEXT_OVERRIDE { return true; }
 
 private:
   HyperVFileCopyUserClient *_userClientInstance = nullptr;
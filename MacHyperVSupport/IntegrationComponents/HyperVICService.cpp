@@ -31,13 +31,52 @@ bool HyperVICService::start(IOService *provider) {
   HVCheckDebugArgs();
   HVDBGLOG("Initializing Hyper-V Integration Component");
 
+  _channelLock = IOLockAlloc();
+  if (_channelLock == nullptr) {
+    HVSYSLOG("Failed to allocate channel lock");
+    OSSafeReleaseNULL(_hvDevice);
+    return false;
+  }
+
   if (!super::start(provider)) {
     HVSYSLOG("super::start() returned false");
     OSSafeReleaseNULL(_hvDevice);
     return false;
   }
 
+  //
+  // Channel offer is accepted, but the ring buffers and work loop are only set up once needed.
+  //
+  if (openChannelOnDemand() && !checkKernelArgument("-hvicnolazy")) {
+    HVDBGLOG("Deferring channel open until a client connects");
+    return true;
+  }
+
+  status = openChannel();
+  result = status == kIOReturnSuccess;
+  
+  if (!result) {
+    stop(provider);
+  }
+  return result;
+}
+
+IOReturn HyperVICService::openChannel() {
+  IOReturn status = kIOReturnSuccess;
+
+  //
+  // Lock is held across the open, so concurrent callers wait for the channel to be opened once.
+  //
+  IOLockLock(_channelLock);
   do {
+    if (_channelOpened) {
+      break;
+    }
+    if (_hvDevice == nullptr) {
+      status = kIOReturnNotAttached;
+      break;
+    }
+
     //
     // Install packet handler.
     //
@@ -54,31 +93,43 @@ bool HyperVICService::start(IOService *provider) {
     status = _hvDevice->openVMBusChannel(txBufferSize(), rxBufferSize());
     if (status != kIOReturnSuccess) {
       HVSYSLOG("Failed to open VMBus channel with status 0x%X", status);
+      _hvDevice->uninstallPacketActions();
+      _hvDevice->releaseWorkLoop();
       break;
     }
 
-    result = true;
+    _channelOpened = true;
   } while (false);
-  
-  if (!result) {
-    stop(provider);
-  }
-  return result;
+  IOLockUnlock(_channelLock);
+
+  return status;
 }
 
 void HyperVICService::stop(IOService *provider) {
   //
   // Close channel and remove handler.
   //
+  IOLockLock(_channelLock);
   if (_hvDevice != nullptr) {
     _hvDevice->closeVMBusChannel();
     _hvDevice->uninstallPacketActions();
     OSSafeReleaseNULL(_hvDevice);
+    _channelOpened = false;
   }
+  IOLockUnlock(_channelLock);
 
   super::stop(provider);
 }
 
+void HyperVICService::free() {
+  if (_channelLock != nullptr) {
+    IOLockFree(_channelLock);
+    _channelLock = nullptr;
+  }
+
+  super::free();
+}
+
 bool HyperVICService::processNegotiationResponse(VMBusICMessageNegotiate *negMsg, const VMBusVersion *msgVersions,
                                                  UInt32 msgVersionsCount, VMBusVersion *msgVersionUsed) {
   UInt32 versionCount;
@@ -20,10 +20,23 @@ class HyperVICService : public IOService {
   HVDeclareLogFunctionsVMBusChild("ic");
   typedef IOService super;
 
+private:
+  //
+  // Channel open state is protected by the lock, as user clients may open the channel concurrently.
+  //
+  IOLock *_channelLock   = nullptr;
+  bool   _channelOpened  = false;
+
 protected:
   HyperVVMBusDevice *_hvDevice = nullptr;
   void setICDebug(bool debug) { debugEnabled = debug; }
 
+  //
+  // Services that are only useful with a userspace daemon can defer opening their channel
+  // until the first user client connects.
+  //
+  virtual bool openChannelOnDemand() { return false; }
+
   virtual void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) = 0;
   virtual UInt32 txBufferSize() { return kHyperVICBufferSize; };
   virtual UInt32 rxBufferSize() { return kHyperVICBufferSize; };
@@ -36,6 +49,12 @@ public:
   //
   virtual bool start(IOService *provider) APPLE_KEXT_OVERRIDE;
   virtual void stop(IOService *provider) APPLE_KEXT_OVERRIDE;
+  virtual void free() APPLE_KEXT_OVERRIDE;
+
+  //
+  // Opens the channel if it was deferred, called by the user client once it has opened the service.
+  //
+  IOReturn openChannel();
 };
 
 #endif
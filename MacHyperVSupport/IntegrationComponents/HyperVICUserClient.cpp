@@ -38,6 +38,16 @@ bool HyperVICUserClient::start(IOService *provider) {
     return false;
   }
 
+  //
+  // Services may defer opening their channel until a client connects.
+  // This is done outside of the open call, as it waits on Hyper-V.
+  //
+  if (_hvICProvider->openChannel() != kIOReturnSuccess) {
+    HVSYSLOG("Failed to open channel for user client");
+    stop(provider);
+    return false;
+  }
+
   _sleepLock = IOLockAlloc();
   if (_sleepLock == nullptr) {
     HVSYSLOG("Failed to allocate sleeping lock");
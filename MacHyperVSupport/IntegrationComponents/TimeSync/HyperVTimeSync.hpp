@@ -25,6 +25,7 @@ private:
 
 protected:
   void handlePacket(VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength) APPLE_KEXT_OVERRIDE;
+  bool openChannelOnDemand() APPLE_KEXT_OVERRIDE { return true; }
 
 public:
   //
@@ -47,6 +47,8 @@ bool HyperVNetwork::start(IOService *provider) {
       HVSYSLOG("Failed to install packet handlers with status 0x%X", status);
       break;
     }
+    _hvDevice->setPacketBudget(kHyperVNetworkPacketBudget);
+    _hvDevice->setLowLatencySignaling(true);
 
 #if DEBUG
     _hvDevice->installTimerDebugPrintAction(this, OSMemberFunctionCast(HyperVVMBusDevice::TimerDebugAction, this, &HyperVNetwork::handleTimer));
@@ -63,7 +65,9 @@ bool HyperVNetwork::start(IOService *provider) {
     
     // TODO
     rndisLock = IOLockAlloc();
+    _hvDevice->recordTimeline(kHyperVTimelinePhaseProtocolHandshake, kHyperVTimelineEventBegin);
     connectNetwork();
+    _hvDevice->recordTimeline(kHyperVTimelinePhaseProtocolHandshake, kHyperVTimelineEventEnd);
     
     //
     // Attach and register network interface.
@@ -73,6 +77,7 @@ bool HyperVNetwork::start(IOService *provider) {
       break;
     }
     _ethInterface->registerService();
+    _hvDevice->recordTimeline(kHyperVTimelinePhaseDeviceReady, kHyperVTimelineEventInstant);
 
     HVDBGLOG("Initialized Hyper-V Synthetic Networking");
     result = true;
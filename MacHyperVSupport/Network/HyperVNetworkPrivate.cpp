@@ -128,8 +128,9 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
 
   //
   // Allocate receive and send buffers and create GPADLs for them.
+  // Both buffers are only accessed through GPADLs and do not need to be physically contiguous.
   //
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_receiveBuffer, _receiveBufferSize, kHyperVDMABufferOptionNonContiguous)) {
     HVSYSLOG("Failed to allocate receive buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -139,7 +140,7 @@ IOReturn HyperVNetwork::initSendReceiveBuffers() {
     freeSendReceiveBuffers();
     return kIOReturnIOError;
   }
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&_sendBuffer, _sendBufferSize, kHyperVDMABufferOptionNonContiguous)) {
     HVSYSLOG("Failed to allocate send buffer");
     freeSendReceiveBuffers();
     return kIOReturnNoResources;
@@ -110,10 +110,13 @@ HyperVNetworkRNDISRequest* HyperVNetwork::allocateRNDISRequest(size_t additional
   
   //
   // Create DMA buffer with required specifications and get physical address.
+  // Buffer is cleared below.
   //
-  if (!_hvDevice->getHvController()->allocateDmaBuffer(&dmaBuffer, sizeof (HyperVNetworkRNDISRequest) + additionalLength)) {
+  if (!_hvDevice->getHvController()->allocateDmaBuffer(&dmaBuffer, sizeof (HyperVNetworkRNDISRequest) + additionalLength,
+                                                       kHyperVDMABufferOptionNoZero)) {
     HVSYSLOG("Failed to allocate buffer memory for RNDIS request");
     IOLockFree(lock);
+    return NULL;
   }
   
   rndisRequest = (HyperVNetworkRNDISRequest*)dmaBuffer.buffer;
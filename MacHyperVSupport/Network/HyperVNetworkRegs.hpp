@@ -18,6 +18,7 @@
 #define kHyperVNetworkSendBufferSize            (1024 * 1024 * 15)
 
 #define kHyperVNetworkReceivePacketSize         (16 * PAGE_SIZE)
+#define kHyperVNetworkPacketBudget              64
 
 #define MBit 1000000
 
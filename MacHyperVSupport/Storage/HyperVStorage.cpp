@@ -50,6 +50,8 @@ bool HyperVStorage::InitializeController() {
       HVSYSLOG("Failed to install packet handler with status 0x%X", status);
       break;
     }
+    _hvDevice->setPacketBudget(kHyperVStoragePacketBudget);
+    _hvDevice->setLowLatencySignaling(true);
 
 #if __MAC_OS_X_VERSION_MIN_REQUIRED < __MAC_10_5
     if (getKernelVersion() < KernelVersion::Leopard) {
@@ -60,17 +62,21 @@ bool HyperVStorage::InitializeController() {
     //
     // Open VMBus channel and connect to storage.
     //
-    status = _hvDevice->openVMBusChannel(kHyperVStorageRingBufferSize, kHyperVStorageRingBufferSize);
+    status = _hvDevice->openVMBusChannel(kHyperVStorageRingBufferSize, kHyperVStorageRingBufferSize, UINT64_MAX,
+                                         kHyperVStorageMaxTargets + kHyperVVMBusDeviceDefaultRequestCount);
     if (status != kIOReturnSuccess) {
       HVSYSLOG("Failed to open VMBus channel with status 0x%X", status);
       break;
     }
 
+    _hvDevice->recordTimeline(kHyperVTimelinePhaseProtocolHandshake, kHyperVTimelineEventBegin);
     status = connectStorage();
     if (status != kIOReturnSuccess) {
       HVSYSLOG("Failed to connect to storage device with status 0x%X", status);
+      _hvDevice->recordTimeline(kHyperVTimelinePhaseProtocolHandshake, kHyperVTimelineEventFailed);
       break;
     }
+    _hvDevice->recordTimeline(kHyperVTimelinePhaseProtocolHandshake, kHyperVTimelineEventEnd);
 
     //
     // Initialize segments used for DMA.
@@ -85,6 +91,11 @@ bool HyperVStorage::InitializeController() {
     // Populate HBA properties and create disk enumeration thread.
     //
     setHBAInfo();
+    _scanSCSIDiskLock = IOLockAlloc();
+    if (_scanSCSIDiskLock == nullptr) {
+      HVSYSLOG("Failed to allocate disk enumeration lock");
+      break;
+    }
     _scanSCSIDiskThread = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &HyperVStorage::scanSCSIDisks), this);
     if (_scanSCSIDiskThread == nullptr) {
       HVSYSLOG("Failed to create disk enumeration thread");
@@ -117,10 +128,16 @@ void HyperVStorage::TerminateController() {
   if (_segs64 != nullptr) {
     IOFree(_segs64, sizeof (IODMACommand::Segment64) * _maxPageSegments);
   }
+
+  if (_scanSCSIDiskLock != nullptr) {
+    IOLockFree(_scanSCSIDiskLock);
+    _scanSCSIDiskLock = nullptr;
+  }
 }
 
 bool HyperVStorage::StartController() {
   HVDBGLOG("Controller is now started");
+  _hvDevice->recordTimeline(kHyperVTimelinePhaseDeviceReady, kHyperVTimelineEventInstant);
   startDiskEnumeration();
   return true;
 }
@@ -49,7 +49,9 @@ private:
   //
   // Thread for disk enumeration.
   //
-  thread_call_t _scanSCSIDiskThread = nullptr;
+  thread_call_t _scanSCSIDiskThread       = nullptr;
+  IOLock        *_scanSCSIDiskLock        = nullptr;
+  UInt32        _scanSCSIDiskPendingCount = 0;
 
   //
   // Packets and I/O.
@@ -66,7 +68,8 @@ private:
   //
   void setHBAInfo();
   IOReturn connectStorage();
-  bool checkSCSIDiskPresent(UInt8 diskId);
+  IOReturn sendSCSIDiskPresentCheck(UInt8 diskId, HyperVStoragePacket *packet);
+  void handleSCSIDiskPresentCompletion(void *context, IOReturn status, UInt8 *pktData, UInt32 pktDataLength);
   void startDiskEnumeration();
   void scanSCSIDisks();
 
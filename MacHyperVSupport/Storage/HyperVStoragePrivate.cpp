@@ -283,45 +283,58 @@ IOReturn HyperVStorage::connectStorage() {
   return kIOReturnSuccess;
 }
 
-bool HyperVStorage::checkSCSIDiskPresent(UInt8 diskId) {
-  IOReturn            status;
-  HyperVStoragePacket packet = { };
-
+IOReturn HyperVStorage::sendSCSIDiskPresentCheck(UInt8 diskId, HyperVStoragePacket *packet) {
   //
   // Prepare SCSI request packet and flags.
   //
-  packet.operation = kHyperVStoragePacketOperationExecuteSRB;
-  packet.flags     = kHyperVStoragePacketFlagRequestCompletion;
+  bzero(packet, sizeof (*packet));
+  packet->operation = kHyperVStoragePacketOperationExecuteSRB;
+  packet->flags     = kHyperVStoragePacketFlagRequestCompletion;
 
-  packet.scsiRequest.targetID                = 0;
-  packet.scsiRequest.lun                     = diskId;
-  packet.scsiRequest.win8Extension.srbFlags |= 0x00000008;
-  packet.scsiRequest.length                  = sizeof (packet.scsiRequest);
-  packet.scsiRequest.senseInfoLength         = _senseBufferSize;
-  packet.scsiRequest.dataIn                  = kHyperVStorageSCSIRequestTypeUnknown;
+  packet->scsiRequest.targetID                = 0;
+  packet->scsiRequest.lun                     = diskId;
+  packet->scsiRequest.win8Extension.srbFlags |= 0x00000008;
+  packet->scsiRequest.length                  = sizeof (packet->scsiRequest);
+  packet->scsiRequest.senseInfoLength         = _senseBufferSize;
+  packet->scsiRequest.dataIn                  = kHyperVStorageSCSIRequestTypeUnknown;
 
   //
   // Set CDB to TEST UNIT READY command.
   //
-  packet.scsiRequest.cdb[0]    = kSCSICmd_TEST_UNIT_READY;
-  packet.scsiRequest.cdb[1]    = 0x00;
-  packet.scsiRequest.cdb[2]    = 0x00;
-  packet.scsiRequest.cdb[3]    = 0x00;
-  packet.scsiRequest.cdb[4]    = 0x00;
-  packet.scsiRequest.cdb[5]    = 0x00;
-  packet.scsiRequest.cdbLength = 6;
+  packet->scsiRequest.cdb[0]    = kSCSICmd_TEST_UNIT_READY;
+  packet->scsiRequest.cdb[1]    = 0x00;
+  packet->scsiRequest.cdb[2]    = 0x00;
+  packet->scsiRequest.cdb[3]    = 0x00;
+  packet->scsiRequest.cdb[4]    = 0x00;
+  packet->scsiRequest.cdb[5]    = 0x00;
+  packet->scsiRequest.cdbLength = 6;
 
   //
-  // Send SCSI packet and check result to see if disk is present.
+  // Send SCSI packet, the response is written back into the same packet on completion.
   //
-  status = _hvDevice->writeInbandPacket(&packet, sizeof (packet) - _packetSizeDelta, true, &packet, sizeof (packet));
-  if (status != kIOReturnSuccess) {
-    HVDBGLOG("Failed to send TEST UNIT READY SCSI packet with status 0x%X", status);
-    return false;
+  return _hvDevice->writeInbandPacketAsync(packet, sizeof (*packet) - _packetSizeDelta, this,
+                                           OSMemberFunctionCast(HyperVVMBusDevice::PacketCompletionAction, this,
+                                                                &HyperVStorage::handleSCSIDiskPresentCompletion), packet);
+}
+
+void HyperVStorage::handleSCSIDiskPresentCompletion(void *context, IOReturn status, UInt8 *pktData, UInt32 pktDataLength) {
+  HyperVStoragePacket *packet = (HyperVStoragePacket*) context;
+
+  //
+  // Disks with no response are treated as not present.
+  //
+  if (status == kIOReturnSuccess && pktData != NULL) {
+    memcpy(packet, pktData, pktDataLength < sizeof (*packet) ? pktDataLength : sizeof (*packet));
+  } else {
+    packet->scsiRequest.srbStatus = 0;
   }
 
-  HVDBGLOG("Disk %u status: 0x%X SRB status: 0x%X", diskId, packet.scsiRequest.scsiStatus, packet.scsiRequest.srbStatus);
-  return packet.scsiRequest.srbStatus == kHyperVSRBStatusSuccess;
+  IOLockLock(_scanSCSIDiskLock);
+  _scanSCSIDiskPendingCount--;
+  if (_scanSCSIDiskPendingCount == 0) {
+    IOLockWakeup(_scanSCSIDiskLock, &_scanSCSIDiskPendingCount, false);
+  }
+  IOLockUnlock(_scanSCSIDiskLock);
 }
 
 void HyperVStorage::startDiskEnumeration() {
@@ -333,10 +346,45 @@ void HyperVStorage::startDiskEnumeration() {
 }
 
 void HyperVStorage::scanSCSIDisks() {
+  IOReturn            status;
+  HyperVStoragePacket *packets;
+
   HVDBGLOG("Starting disk scan of %u disks", kHyperVStorageMaxTargets);
+  packets = (HyperVStoragePacket*) IOMalloc(sizeof (*packets) * kHyperVStorageMaxTargets);
+  if (packets == nullptr) {
+    HVSYSLOG("Failed to allocate disk scan packets");
+    return;
+  }
+
+  //
+  // Send TEST UNIT READY to all disks at once, and wait for all of them to complete.
+  //
+  _scanSCSIDiskPendingCount = 0;
+  for (UInt32 lun = 0; lun < kHyperVStorageMaxTargets; lun++) {
+    IOLockLock(_scanSCSIDiskLock);
+    _scanSCSIDiskPendingCount++;
+    IOLockUnlock(_scanSCSIDiskLock);
+
+    status = sendSCSIDiskPresentCheck(lun, &packets[lun]);
+    if (status != kIOReturnSuccess) {
+      HVDBGLOG("Failed to send TEST UNIT READY SCSI packet to disk %u with status 0x%X", lun, status);
+      packets[lun].scsiRequest.srbStatus = 0;
+
+      IOLockLock(_scanSCSIDiskLock);
+      _scanSCSIDiskPendingCount--;
+      IOLockUnlock(_scanSCSIDiskLock);
+    }
+  }
+
+  IOLockLock(_scanSCSIDiskLock);
+  while (_scanSCSIDiskPendingCount != 0) {
+    IOLockSleep(_scanSCSIDiskLock, &_scanSCSIDiskPendingCount, THREAD_UNINT);
+  }
+  IOLockUnlock(_scanSCSIDiskLock);
 
   for (UInt32 lun = 0; lun < kHyperVStorageMaxTargets; lun++) {
-    if (checkSCSIDiskPresent(lun)) {
+    HVDBGLOG("Disk %u status: 0x%X SRB status: 0x%X", lun, packets[lun].scsiRequest.scsiStatus, packets[lun].scsiRequest.srbStatus);
+    if (packets[lun].scsiRequest.srbStatus == kHyperVSRBStatusSuccess) {
       if (GetTargetForID(lun) == nullptr) {
         HVDBGLOG("Disk %u is newly added", lun);
         CreateTargetForID(lun);
@@ -351,5 +399,6 @@ void HyperVStorage::scanSCSIDisks() {
     }
   }
 
+  IOFree(packets, sizeof (*packets) * kHyperVStorageMaxTargets);
   HVDBGLOG("Completed disk scan");
 }
@@ -16,6 +16,7 @@
 
 #define kHyperVStorageSenseBufferSize         0x14
 #define kHyperVStorageMaxBufferLengthPadding  0x14
+#define kHyperVStoragePacketBudget            32
 
 #define kHyperVStorageVendor                  "Microsoft"
 #define kHyperVStorageProduct                 "Hyper-V SCSI Controller"
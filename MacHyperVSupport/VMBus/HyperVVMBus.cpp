@@ -81,6 +81,10 @@ bool HyperVVMBus::attach(IOService *provider) {
     
     _cmdGate = IOCommandGate::commandGate(this);
     getWorkLoop()->addEventSource(_cmdGate);
+    initVMBusChannelCPUPolicy();
+    if (!initSharedWorkLoops()) {
+      break;
+    }
     if (!allocateInterruptEventSources()) {
       HVSYSLOG("Failed to configure VMBus management interrupts");
       break;
@@ -90,15 +94,21 @@ bool HyperVVMBus::attach(IOService *provider) {
       break;
     }
 
+    hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusConnect, kHyperVTimelineEventBegin);
     if (!connectVMBus()) {
       HVSYSLOG("Failed to connect to the VMBus");
+      hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusConnect, kHyperVTimelineEventFailed);
       break;
     }
+    hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusConnect, kHyperVTimelineEventEnd);
     
+    hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusScan, kHyperVTimelineEventBegin);
     if (!scanVMBus()) {
       HVSYSLOG("Failed to scan the VMBus");
+      hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusScan, kHyperVTimelineEventFailed);
       break;
     }
+    hvController->recordTimeline(0, kHyperVTimelinePhaseVMBusScan, kHyperVTimelineEventEnd);
     
     result = true;
   } while (false);
@@ -106,6 +116,11 @@ bool HyperVVMBus::attach(IOService *provider) {
   return result;
 }
 
+void HyperVVMBus::free() {
+  freeSharedWorkLoops();
+  super::free();
+}
+
 bool HyperVVMBus::sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType, VMBusChannelMessage *response) {
   if (responseType != kVMBusChannelMessageTypeInvalid && response == NULL) {
     return false;
@@ -121,13 +136,38 @@ bool HyperVVMBus::sendVMBusMessageWithSize(VMBusChannelMessage *message, UInt32
 }
 
 IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32 *messageSize, VMBusChannelMessageType *responseType, VMBusChannelMessage *responseMessage) {
+  IOReturn           status;
+  VMBusMessageWaiter *waiter = nullptr;
+  UInt32             size    = messageSize != NULL ? *messageSize : VMBusMessageTypeTable[message->header.type].size;
+
+  //
+  // Register for the response before posting, responses are keyed off the request.
+  //
+  if (*responseType != kVMBusChannelMessageTypeInvalid) {
+    waiter = acquireVMBusMessageWaiterGated(*responseType, getVMBusMessageWaitKey(message));
+  }
+
+  status = postVMBusMessageGated(message, size);
+  if (status != kIOReturnSuccess) {
+    if (waiter != nullptr) {
+      releaseVMBusMessageWaiterGated(waiter);
+    }
+    return status;
+  }
   
+  if (waiter != nullptr) {
+    waitVMBusMessageGated(waiter, responseMessage);
+  }
+  
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBus::postVMBusMessageGated(VMBusChannelMessage *message, UInt32 size) {
   HypercallStatus hvStatus = kHypercallStatusSuccess;
   IOReturn returnStatus = kIOReturnSuccess;
   bool postCompleted = false;
   
   const VMBusMessageTypeTableEntry *msgEntry = &VMBusMessageTypeTable[message->header.type];
-  UInt32 size = messageSize != NULL ? *messageSize : msgEntry->size;
   
   //
   // Multiple hypercalls may fail due to lack of resources on the host
@@ -161,33 +201,78 @@ IOReturn HyperVVMBus::sendVMBusMessageGated(VMBusChannelMessage *message, UInt32
   
   if (returnStatus != kIOReturnSuccess) {
     HVSYSLOG("Hypercall message type 0x%X failed with status 0x%X", msgEntry->type, hvStatus);
-    return returnStatus;
   }
-  
-  if (*responseType != kVMBusChannelMessageTypeInvalid) {
-    //
-    // Wait for response.
-    //
-    _vmbusWaitForMessageType = *responseType;
-    _cmdGate->commandSleep(&_cmdGateEvent);
+  return returnStatus;
+}
 
-    HVDBGLOG("Awoken from sleep, message type is %u with size %u", _vmbusWaitMessage.type, _vmbusWaitMessage.size);
-    memcpy(responseMessage, _vmbusWaitMessage.data, VMBusMessageTypeTable[*responseType].size);
+UInt32 HyperVVMBus::getVMBusMessageWaitKey(VMBusChannelMessage *message) {
+  //
+  // Get the key shared by a request and its response.
+  // Management messages without a channel or GPADL only have one outstanding request at a time.
+  //
+  switch (message->header.type) {
+    case kVMBusChannelMessageTypeChannelOpen:
+      return ((VMBusChannelMessageChannelOpen*) message)->channelId;
+    case kVMBusChannelMessageTypeChannelOpenResponse:
+      return ((VMBusChannelMessageChannelOpenResponse*) message)->channelId;
+    case kVMBusChannelMessageTypeGPADLHeader:
+      return ((VMBusChannelMessageGPADLHeader*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLCreated:
+      return ((VMBusChannelMessageGPADLCreated*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardown:
+      return ((VMBusChannelMessageGPADLTeardown*) message)->gpadl;
+    case kVMBusChannelMessageTypeGPADLTeardownResponse:
+      return ((VMBusChannelMessageGPADLTeardownResponse*) message)->gpadl;
+    default:
+      return 0;
   }
-  
-  return kIOReturnSuccess;
 }
 
-void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
+VMBusMessageWaiter *HyperVVMBus::acquireVMBusMessageWaiterGated(VMBusChannelMessageType responseType, UInt32 key) {
   //
-  // Sometimes the interrupt will fire for the same message, and by the time this
-  // handler is invoked for that second interrupt, the message will be cleared.
+  // Wait for a free waiter if all are in use.
   //
-  HyperVMessage *vmbusMessage = hvController->getPendingMessage(cpu, kVMBusInterruptMessage);
-  if (vmbusMessage->type == kHyperVMessageTypeNone) {
-    return;
+  while (true) {
+    for (UInt32 i = 0; i < kVMBusMaxMessageWaiters; i++) {
+      if (!_vmbusWaiters[i].inUse) {
+        _vmbusWaiters[i].inUse        = true;
+        _vmbusWaiters[i].completed    = false;
+        _vmbusWaiters[i].responseType = responseType;
+        _vmbusWaiters[i].key          = key;
+        return &_vmbusWaiters[i];
+      }
+    }
+
+    HVDBGLOG("All message waiters are in use, waiting");
+    _cmdGate->commandSleep(_vmbusWaiters);
   }
-  
+}
+
+void HyperVVMBus::releaseVMBusMessageWaiterGated(VMBusMessageWaiter *waiter) {
+  waiter->inUse = false;
+  _cmdGate->commandWakeup(_vmbusWaiters);
+}
+
+void HyperVVMBus::waitVMBusMessageGated(VMBusMessageWaiter *waiter, VMBusChannelMessage *responseMessage) {
+  //
+  // Wait for response.
+  // Incoming messages are processed on the work loop, so the response cannot arrive before we sleep.
+  // Other requests may be posted while sleeping, as the command gate is released.
+  //
+  while (!waiter->completed) {
+    _cmdGate->commandSleep(waiter);
+  }
+
+  HVDBGLOG("Awoken from sleep, message type is %u with size %u", waiter->message.type, waiter->message.size);
+  memcpy(responseMessage, waiter->message.data, VMBusMessageTypeTable[waiter->responseType].size);
+  releaseVMBusMessageWaiterGated(waiter);
+}
+
+void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu, HyperVMessage *vmbusMessage) {
+  //
+  // Message has already been copied out of the SynIC message slot, and end-of-message signaled
+  // on the receiving CPU. See VMBusInterruptProcessor.
+  //
   HVDBGLOG("CPU %u has a message (type %u)", cpu, vmbusMessage->type);
   
   //
@@ -197,18 +282,20 @@ void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
     VMBusChannelMessage *msg = (VMBusChannelMessage*) &vmbusMessage->data[0];
     HVDBGLOG("Incoming VMBus message type %u on CPU %u", msg->header.type, cpu);
     
-    if (_vmbusWaitForMessageType != kVMBusChannelMessageTypeInvalid && _vmbusWaitForMessageType == msg->header.type) {
-      HVDBGLOG("Woke for response %u", _vmbusWaitForMessageType);
-      _vmbusWaitForMessageType = kVMBusChannelMessageTypeInvalid;
-      
-      //
-      // Store message response.
-      //
-      memcpy(&_vmbusWaitMessage, vmbusMessage, sizeof (_vmbusWaitMessage));
-      hvController->sendSynICEOM(cpu);
-      
-      _cmdGate->commandWakeup(&_cmdGateEvent);
-      return;
+    UInt32 key = getVMBusMessageWaitKey(msg);
+    for (UInt32 i = 0; i < kVMBusMaxMessageWaiters; i++) {
+      VMBusMessageWaiter *waiter = &_vmbusWaiters[i];
+      if (waiter->inUse && !waiter->completed && waiter->responseType == msg->header.type && waiter->key == key) {
+        HVDBGLOG("Woke for response %u (key 0x%X)", waiter->responseType, key);
+
+        //
+        // Store message response.
+        //
+        memcpy(&waiter->message, vmbusMessage, sizeof (waiter->message));
+        waiter->completed = true;
+        _cmdGate->commandWakeup(waiter);
+        return;
+      }
     }
     
     //
@@ -221,8 +308,6 @@ void HyperVVMBus::processIncomingVMBusMessage(UInt32 cpu) {
     } else {
       HVDBGLOG("Unknown message type %u", msg->header.type);
     }
-    hvController->sendSynICEOM(cpu);
-    
   } else if (vmbusMessage->type == kVMBusConnIdEvent) {
     HVDBGLOG("Incoming VMBus event on CPU %u", cpu);
   }
@@ -314,11 +399,13 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
   //
   // Add offer message to channel array.
   //
+  bool   result;
   UInt32 channelId = offerMessage->channelId;
   if (channelId >= kVMBusMaxChannels || _vmbusChannels[channelId].status != kVMBusChannelStatusNotPresent) {
     HVDBGLOG("Channel %u is invalid or already present", channelId);
     return false;
   }
+  hvController->recordTimeline(channelId, kHyperVTimelinePhaseChannelOffer, kHyperVTimelineEventInstant);
   
   //
   // Copy offer message and create GUID type string.
@@ -326,15 +413,27 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
   memcpy(&_vmbusChannels[channelId].offerMessage, offerMessage, sizeof (VMBusChannelMessageChannelOffer));
   guid_unparse(offerMessage->type, _vmbusChannels[channelId].typeGuidString);
   memcpy(_vmbusChannels[channelId].instanceId, offerMessage->instance, sizeof (offerMessage->instance));
+  _vmbusChannels[channelId].hasRequestedCpu = false;
+  _vmbusChannels[channelId].targetCpu       = 0;
   _vmbusChannels[channelId].status = kVMBusChannelStatusClosed;
+  _vmbusChannels[channelId].primaryChannelId = 0;
   
-  if (!registerVMBusDevice(&_vmbusChannels[channelId])) {
+  //
+  // Sub-channels are attached to their primary channel instead of being matched by drivers.
+  //
+  if (offerMessage->channelSubIndex != 0) {
+    result = addVMBusSubChannel(&_vmbusChannels[channelId]);
+  } else {
+    result = registerVMBusDevice(&_vmbusChannels[channelId]);
+  }
+  if (!result) {
     HVDBGLOG("Failed to register channel %u", channelId);
     cleanupVMBusDevice(&_vmbusChannels[channelId]);
     return false;
   }
   
-  HVDBGLOG("Registered channel %u (%s)", channelId, _vmbusChannels[channelId].typeGuidString);
+  HVDBGLOG("Registered channel %u (%s, sub-channel index %u)", channelId, _vmbusChannels[channelId].typeGuidString,
+           _vmbusChannels[channelId].offerMessage.channelSubIndex);
   HVDBGLOG("Channel %u flags 0x%X, MIMO size %u bytes, pipe mode 0x%X", channelId,
            _vmbusChannels[channelId].offerMessage.flags, _vmbusChannels[channelId].offerMessage.mmioSizeMegabytes,
            _vmbusChannels[channelId].offerMessage.pipe.mode);
@@ -350,6 +449,15 @@ bool HyperVVMBus::addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage)
     _vmbusChannels[channelId].connectionSignalId    = kVMBusConnIdEvent;
   }
 
+  //
+  // Channels with a monitor ID can be signaled through the monitor page.
+  //
+  _vmbusChannels[channelId].lowLatency   = false;
+  _vmbusChannels[channelId].useMonitor   = _vmbusMonitorSignaling && _vmbusChannels[channelId].offerMessage.monitorAllocated
+                                             && _vmbusChannels[channelId].offerMessage.monitorId < kHyperVMonitorMaxId;
+  _vmbusChannels[channelId].monitorGroup = _vmbusChannels[channelId].offerMessage.monitorId / kHyperVMonitorTriggerGroupBits;
+  _vmbusChannels[channelId].monitorBit   = _vmbusChannels[channelId].offerMessage.monitorId % kHyperVMonitorTriggerGroupBits;
+
   return true;
 }
 
@@ -371,9 +479,61 @@ void HyperVVMBus::removeVMBusDevice(VMBusChannelMessageChannelRescindOffer *resc
     _vmbusChannels[channelId].deviceNub = NULL;
   }
   HVDBGLOG("Channel %u has been asked to terminate", channelId);
+
+  //
+  // Sub-channel nubs are not usable without their primary channel, terminate any still present.
+  // Sub-channel nubs are kept until freed, as the primary channel client may still reference them.
+  //
+  if (_vmbusChannels[channelId].primaryChannelId == 0) {
+    for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+      if (_vmbusChannels[i].primaryChannelId != channelId || _vmbusChannels[i].deviceNub == NULL) {
+        continue;
+      }
+      _vmbusChannels[i].deviceNub->terminate();
+      _vmbusChannels[i].deviceNub->release();
+      _vmbusChannels[i].deviceNub = NULL;
+      HVDBGLOG("Sub-channel %u of channel %u has been asked to terminate", i, channelId);
+    }
+  }
+}
+
+bool HyperVVMBus::addVMBusSubChannel(VMBusChannel *channel) {
+  VMBusChannel *primaryChannel;
+
+  //
+  // Locate primary channel with the same type and instance.
+  //
+  for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+    primaryChannel = &_vmbusChannels[i];
+    if (primaryChannel->status == kVMBusChannelStatusNotPresent || primaryChannel->deviceNub == nullptr
+        || primaryChannel->offerMessage.channelSubIndex != 0) {
+      continue;
+    }
+    if (strcmp(primaryChannel->typeGuidString, channel->typeGuidString) != 0
+        || memcmp(primaryChannel->instanceId, channel->instanceId, sizeof (channel->instanceId)) != 0) {
+      continue;
+    }
+
+    channel->primaryChannelId = i;
+    if (!registerVMBusDevice(channel, true)) {
+      channel->primaryChannelId = 0;
+      return false;
+    }
+
+    //
+    // Wake any threads waiting on sub-channels for the primary channel.
+    //
+    HVDBGLOG("Channel %u is sub-channel %u of channel %u", channel->offerMessage.channelId,
+             channel->offerMessage.channelSubIndex, i);
+    _cmdGate->commandWakeup(primaryChannel);
+    return true;
+  }
+
+  HVSYSLOG("Primary channel for sub-channel %u was not found", channel->offerMessage.channelId);
+  return false;
 }
 
-bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
+bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel, bool isSubChannel) {
   //
   // Allocate and initialize child VMBus device object.
   //
@@ -419,6 +579,11 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
   if (mmioBytesNumber != nullptr) {
     result &= dict->setObject(kHyperVVMBusDeviceChannelMMIOByteCount, mmioBytesNumber);
   }
+  if (isSubChannel) {
+    OSNumber *subIndexNumber = OSNumber::withNumber(channel->offerMessage.channelSubIndex, 16);
+    result &= (subIndexNumber != nullptr) && dict->setObject(kHyperVVMBusDeviceSubChannelIndexKey, subIndexNumber);
+    OSSafeReleaseNULL(subIndexNumber);
+  }
 
   devType->release();
   devInstance->release();
@@ -448,7 +613,15 @@ bool HyperVVMBus::registerVMBusDevice(VMBusChannel *channel) {
     return false;
   }
 
-  childDevice->registerService();
+  //
+  // Matching and driver start are performed asynchronously on IOKit configuration threads.
+  // Devices are brought up concurrently, with management message responses routed to each waiter.
+  //
+  // Sub-channels are not matched, and are only used through the primary channel nub.
+  //
+  if (!isSubChannel) {
+    childDevice->registerService();
+  }
   channel->deviceNub = childDevice;
 
   return true;
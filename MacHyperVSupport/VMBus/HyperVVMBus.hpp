@@ -11,7 +11,9 @@
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOEventSource.h>
 #include <IOKit/IOInterruptEventSource.h>
+#include <IOKit/IOMemoryDescriptor.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
 
 #include "HyperV.hpp"
 #include "VMBus.hpp"
@@ -20,6 +22,32 @@
 
 #define kVMBusArrayInitialChildrenCount        10
 
+//
+// Channel interrupt CPU policies.
+//
+typedef enum {
+  //
+  // All channel interrupts are targeted at CPU 0.
+  //
+  kVMBusChannelCPUPolicyFirst = 0,
+  //
+  // Channel interrupts are spread across all CPUs.
+  //
+  kVMBusChannelCPUPolicyRoundRobin,
+  //
+  // High throughput channels (network, storage, PCI passthrough) are spread across all CPUs,
+  // all others are targeted at CPU 0.
+  //
+  kVMBusChannelCPUPolicyByType,
+
+  kVMBusChannelCPUPolicyMax
+} VMBusChannelCPUPolicy;
+
+//
+// Clears a device requested channel interrupt CPU, reverting to the policy.
+//
+#define kVMBusChannelTargetCPUAny   0xFFFFFFFF
+
 class HyperVVMBusDevice;
 class VMBusInterruptProcessor;
 
@@ -43,6 +71,21 @@ typedef struct {
   VMBusChannelMessageChannelOffer offerMessage;
   bool                            useDedicatedInterrupt;
   UInt32                          connectionSignalId;
+
+  //
+  // Monitored notification, used for signaling Hyper-V unless the channel requires low latency.
+  //
+  bool                            useMonitor;
+  bool                            lowLatency;
+  UInt8                           monitorGroup;
+  UInt8                           monitorBit;
+
+  //
+  // CPU requested by the device for channel interrupts, and CPU interrupts were targeted at when opened.
+  //
+  bool                            hasRequestedCpu;
+  UInt32                          requestedCpu;
+  UInt32                          targetCpu;
   
   //
   // Unique GPADL handle for this channel.
@@ -58,6 +101,21 @@ typedef struct {
   
   VMBusRingBuffer                 *txBuffer;
   VMBusRingBuffer                 *rxBuffer;
+
+  //
+  // Ring buffer data pages mapped twice back-to-back, if available.
+  //
+  IOMemoryDescriptor              *txMirrorDesc;
+  IOMemoryMap                     *txMirrorMap;
+  UInt8                           *txMirror;
+  IOMemoryDescriptor              *rxMirrorDesc;
+  IOMemoryMap                     *rxMirrorMap;
+  UInt8                           *rxMirror;
+  
+  //
+  // Primary channel for sub-channels, 0 for primary channels.
+  //
+  UInt32                          primaryChannelId;
   
   //
   // I/O Kit nub for VMBus device.
@@ -65,6 +123,20 @@ typedef struct {
   HyperVVMBusDevice               *deviceNub;
 } VMBusChannel;
 
+//
+// Outstanding management message response.
+// Responses are matched by type and key, which is the channel ID or GPADL handle where applicable.
+//
+#define kVMBusMaxMessageWaiters   16
+
+typedef struct {
+  bool                      inUse;
+  bool                      completed;
+  VMBusChannelMessageType   responseType;
+  UInt32                    key;
+  HyperVMessage             message;
+} VMBusMessageWaiter;
+
 class HyperVVMBus : public IOService {
   OSDeclareDefaultStructors(HyperVVMBus);
   HVDeclareLogFunctions("vmbus");
@@ -96,23 +168,44 @@ private:
   HyperVEventFlags    *vmbusTxEventFlags;
   HyperVDMABuffer     _vmbusMnf1 = { };
   HyperVDMABuffer     _vmbusMnf2 = { };
+  HyperVMonitorPage   *_vmbusMonitorPage     = nullptr;
+  bool                _vmbusMonitorSignaling = true;
   
   //
-  // Flag used for waiting for incoming message response.
-  // 0 = disable.
+  // Waiters for incoming message responses.
+  // Multiple devices may be waiting on responses at once, each waiter is protected by the command gate.
   //
-  UInt8               _vmbusWaitForMessageType = 0;
-  UInt32              _vmbusWaitMessageCpu = 0;
-  HyperVMessage       _vmbusWaitMessage = { };
+  VMBusMessageWaiter  _vmbusWaiters[kVMBusMaxMessageWaiters] = { };
   
   IOCommandGate           *_cmdGate = nullptr;
   bool                    _cmdShouldWake = false;
-  bool                    _cmdGateEvent = false;
   
   
   UInt32                  _nextGpadlHandle      = kHyperVGpadlNullHandle;
+
+  //
+  // GPADL header and body messages are built here, protected by the command gate.
+  //
+  UInt64                  _gpadlMessageBuffer[kHyperVMessageDataSize / sizeof (UInt64)] = { };
   UInt32                  _vmbusVersion         = 0;
   UInt16                  _vmbusMsgConnectionId = 0;
+
+  //
+  // Channel interrupt CPU targeting.
+  // All channels are targeted at CPU 0 unless another policy is selected with hvvmbuscpu=.
+  //
+  bool                    _channelCPUTargeting  = true;
+  VMBusChannelCPUPolicy   _channelCPUPolicy     = kVMBusChannelCPUPolicyFirst;
+  volatile UInt32         _nextChannelCPU       = 0;
+
+  //
+  // Work loops shared by low-rate devices, one per CPU and created on first use.
+  // Channels are spread across the pool by channel ID unless the device requested a target CPU.
+  //
+  bool                    _sharedWorkLoopsEnabled = true;
+  IOLock                  *_sharedWorkLoopsLock   = nullptr;
+  IOWorkLoop              **_sharedWorkLoops      = nullptr;
+  UInt32                  _sharedWorkLoopsCount   = 0;
 public:
   VMBusChannel            _vmbusChannels[kVMBusMaxChannels] = { };
   
@@ -126,7 +219,7 @@ private:
   bool allocateInterruptEventSources();
   void freeInterruptEventSources();
   
-  void processIncomingVMBusMessage(UInt32 cpu);
+  void processIncomingVMBusMessage(UInt32 cpu, HyperVMessage *vmbusMessage);
   //
   // VMBus functions.
   //
@@ -134,12 +227,21 @@ private:
   bool sendVMBusMessage(VMBusChannelMessage *message, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
   bool sendVMBusMessageWithSize(VMBusChannelMessage *message, UInt32 messageSize, VMBusChannelMessageType responseType = kVMBusChannelMessageTypeInvalid, VMBusChannelMessage *response = NULL);
   IOReturn sendVMBusMessageGated(VMBusChannelMessage *message, UInt32 *messageSize, VMBusChannelMessageType *responseType, VMBusChannelMessage *response);
+  IOReturn postVMBusMessageGated(VMBusChannelMessage *message, UInt32 size);
+  UInt32 getVMBusMessageWaitKey(VMBusChannelMessage *message);
+  VMBusMessageWaiter *acquireVMBusMessageWaiterGated(VMBusChannelMessageType responseType, UInt32 key);
+  void releaseVMBusMessageWaiterGated(VMBusMessageWaiter *waiter);
+  void waitVMBusMessageGated(VMBusMessageWaiter *waiter, VMBusChannelMessage *response);
+  UInt32 getGPADLPFNs(HyperVDMABuffer *dmaBuffer, UInt64 *offset, UInt64 *pfns, UInt32 pfnCount);
+  IOReturn initVMBusChannelGPADLGated(UInt32 *channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle,
+                                      VMBusChannelMessageGPADLCreated *gpadlCreated);
   bool connectVMBus();
   bool negotiateVMBus(UInt32 version);
   bool scanVMBus();
   bool addVMBusDevice(VMBusChannelMessageChannelOffer *offerMessage);
   void removeVMBusDevice(VMBusChannelMessageChannelRescindOffer *rescindOfferMessage);
-  bool registerVMBusDevice(VMBusChannel *channel);
+  bool registerVMBusDevice(VMBusChannel *channel, bool isSubChannel = false);
+  bool addVMBusSubChannel(VMBusChannel *channel);
   void cleanupVMBusDevice(VMBusChannel *channel);
   
   //
@@ -148,12 +250,24 @@ private:
   
 
   void freeVMBusChannel(UInt32 channelId);
+  UInt8 *mapVMBusChannelRingMirror(VMBusChannel *channel, UInt32 ringOffset, UInt32 ringSize,
+                                   IOMemoryDescriptor **mirrorDesc, IOMemoryMap **mirrorMap);
+  void unmapVMBusChannelRingMirror(IOMemoryDescriptor **mirrorDesc, IOMemoryMap **mirrorMap, UInt8 **mirror);
+  void initVMBusChannelCPUPolicy();
+  UInt32 selectVMBusChannelTargetCPU(UInt32 channelId);
+  bool initSharedWorkLoops();
+  void freeSharedWorkLoops();
+  IOWorkLoop *copySharedWorkLoop(UInt32 channelId);
+  IOReturn getVMBusSubChannelCountGated(UInt32 *primaryChannelId, UInt32 *count);
+  IOReturn waitForVMBusSubChannelsGated(UInt32 *primaryChannelId, UInt32 *count, AbsoluteTime *deadline);
+  IOReturn copyVMBusSubChannelGated(UInt32 *primaryChannelId, UInt32 *index, HyperVVMBusDevice **device);
   
 public:
   //
   // IOService overrides.
   //
   bool attach(IOService *provider) APPLE_KEXT_OVERRIDE;
+  void free() APPLE_KEXT_OVERRIDE;
   
   //
   // Misc functions.
@@ -164,11 +278,23 @@ public:
   // VMBus channel management.
   //
   VMBusChannelStatus getVMBusChannelStatus(UInt32 channelId);
-  IOReturn openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VMBusRingBuffer **txBuffer, UInt32 rxBufferSize, VMBusRingBuffer **rxBuffer);
+  IOReturn openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VMBusRingBuffer **txBuffer, UInt32 rxBufferSize, VMBusRingBuffer **rxBuffer,
+                            UInt8 **txMirror = nullptr, UInt8 **rxMirror = nullptr);
   IOReturn closeVMBusChannel(UInt32 channelId);
   IOReturn initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle);
   IOReturn freeVMBusChannelGPADL(UInt32 channelId, UInt32 gpadlHandle);
   void signalVMBusChannel(UInt32 channelId);
+  IOReturn setVMBusChannelTargetCPU(UInt32 channelId, UInt32 cpu);
+  IOReturn setVMBusChannelLowLatency(UInt32 channelId, bool lowLatency);
+  UInt32 getVMBusChannelTargetCPU(UInt32 channelId);
+
+  //
+  // Sub-channel management.
+  // Sub-channels are offered by Hyper-V once requested through the device protocol on the primary channel.
+  //
+  UInt32 getVMBusSubChannelCount(UInt32 primaryChannelId);
+  IOReturn waitForVMBusSubChannels(UInt32 primaryChannelId, UInt32 count, UInt32 timeoutMs);
+  HyperVVMBusDevice *copyVMBusSubChannel(UInt32 primaryChannelId, UInt32 index);
 };
 
 #endif
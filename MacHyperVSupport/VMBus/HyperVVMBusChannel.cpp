@@ -6,6 +6,12 @@
 //
 
 #include "HyperVVMBus.hpp"
+#include "HyperVVMBusDevice.hpp"
+
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
+#include <IOKit/IOSubMemoryDescriptor.h>
+#endif
 
 VMBusChannelStatus HyperVVMBus::getVMBusChannelStatus(UInt32 channelId) {
   if (channelId == 0 || channelId >= kVMBusMaxChannels) {
@@ -15,7 +21,8 @@ VMBusChannelStatus HyperVVMBus::getVMBusChannelStatus(UInt32 channelId) {
   return _vmbusChannels[channelId].status;
 }
 
-IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VMBusRingBuffer **txBuffer, UInt32 rxBufferSize, VMBusRingBuffer **rxBuffer) {
+IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VMBusRingBuffer **txBuffer, UInt32 rxBufferSize, VMBusRingBuffer **rxBuffer,
+                                       UInt8 **txMirror, UInt8 **rxMirror) {
   IOReturn     status;
   VMBusChannel *channel;
   
@@ -64,8 +71,9 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   //
   // Allocate channel ring buffers.
   // TX and RX ring buffers are allocated and provided to Hyper-V as a single large buffer.
+  // Ring buffers are only accessed by Hyper-V through the GPADL, and do not need to be physically contiguous.
   //
-  getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize);
+  getHvController()->allocateDmaBuffer(&channel->dataBuffer, totalBufferSize, kHyperVDMABufferOptionNonContiguous);
   getHvController()->allocateDmaBuffer(&channel->eventBuffer, PAGE_SIZE);
   
   //
@@ -85,6 +93,25 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   channel->txBuffer    = (VMBusRingBuffer*) channel->dataBuffer.buffer;
   channel->rxBuffer    = (VMBusRingBuffer*) (((UInt8*)channel->dataBuffer.buffer) + (PAGE_SIZE * rxPageIndex));
   channel->rxPageIndex = rxPageIndex;
+
+  //
+  // Indicate to Hyper-V that we honor the pending send size on the RX ring buffer,
+  // and will notify it once enough space has been freed.
+  //
+  channel->rxBuffer->features.pendingSendSizeSupported = 1;
+
+  //
+  // Map the data pages of each ring buffer twice, back-to-back, so packets wrapping around
+  // the end of a ring buffer can be accessed linearly. This is optional, and the device nub
+  // falls back to handling wraparound itself if the mapping could not be created.
+  //
+  if (!checkKernelArgument("-hvvmbusnomirror")) {
+    channel->txMirror = mapVMBusChannelRingMirror(channel, PAGE_SIZE, txBufferSize - PAGE_SIZE,
+                                                  &channel->txMirrorDesc, &channel->txMirrorMap);
+    channel->rxMirror = mapVMBusChannelRingMirror(channel, (PAGE_SIZE * rxPageIndex) + PAGE_SIZE, rxBufferSize - PAGE_SIZE,
+                                                  &channel->rxMirrorDesc, &channel->rxMirrorMap);
+    HVDBGLOG("Channel %u TX ring mirror %p, RX ring mirror %p", channelId, channel->txMirror, channel->rxMirror);
+  }
   
   //
   // Create channel open message.
@@ -95,22 +122,22 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   openMsg.channelId                       = channelId;
   openMsg.ringBufferGpadlHandle           = channel->dataGpadlHandle;
   openMsg.downstreamRingBufferPageOffset  = channel->rxPageIndex;
-  openMsg.targetCpu                       = 0;
 
   //
   // Windows Server 2012 / Windows 8, and newer, support specific CPUs for interrupts.
-  // TODO: Does not work on newer versions like Monterey, interrupts on other CPUs never arrive.
+  // Hyper-V expects the virtual processor index of the target CPU, not the XNU CPU number.
   //
-  /*if (_vmbusVersion >= kVMBusVersionWIN8 && !checkKernelArgument("-hvvmbusnocpu")) {
-    openMsg.targetCpu = channelId % real_ncpus;
-  }
-  HVDBGLOG("Channel %u target CPU: %u", channelId, openMsg.targetCpu);*/
+  channel->targetCpu = selectVMBusChannelTargetCPU(channelId);
+  openMsg.targetCpu  = getHvController()->getVirtualCPUIndex(channel->targetCpu);
+  HVDBGLOG("Channel %u target CPU: %u (VP index %u)", channelId, channel->targetCpu, openMsg.targetCpu);
 
   //
   // Send channel open message to Hyper-V and wait for response.
   //
   VMBusChannelMessageChannelOpenResponse openResponseMsg;
   if (!sendVMBusMessage((VMBusChannelMessage*) &openMsg, kVMBusChannelMessageTypeChannelOpenResponse, (VMBusChannelMessage*) &openResponseMsg)) {
+    unmapVMBusChannelRingMirror(&channel->txMirrorDesc, &channel->txMirrorMap, &channel->txMirror);
+    unmapVMBusChannelRingMirror(&channel->rxMirrorDesc, &channel->rxMirrorMap, &channel->rxMirror);
     getHvController()->freeDmaBuffer(&channel->dataBuffer);
     getHvController()->freeDmaBuffer(&channel->eventBuffer);
     return kIOReturnIOError;
@@ -118,12 +145,20 @@ IOReturn HyperVVMBus::openVMBusChannel(UInt32 channelId, UInt32 txBufferSize, VM
   HVDBGLOG("Channel %u open result: 0x%X", channelId, openResponseMsg.status);
   
   if (openResponseMsg.status != kHyperVStatusSuccess) {
+    unmapVMBusChannelRingMirror(&channel->txMirrorDesc, &channel->txMirrorMap, &channel->txMirror);
+    unmapVMBusChannelRingMirror(&channel->rxMirrorDesc, &channel->rxMirrorMap, &channel->rxMirror);
     return kIOReturnIOError;
   }
   
   channel->status = kVMBusChannelStatusOpen;
   *txBuffer = channel->txBuffer;
   *rxBuffer = channel->rxBuffer;
+  if (txMirror != nullptr) {
+    *txMirror = channel->txMirror;
+  }
+  if (rxMirror != nullptr) {
+    *rxMirror = channel->rxMirror;
+  }
   
   HVDBGLOG("Channel %u configured (TX size: %u bytes, RX size: %u bytes)", channelId, txBufferSize, rxBufferSize);
   return kIOReturnSuccess;
@@ -167,6 +202,8 @@ IOReturn HyperVVMBus::closeVMBusChannel(UInt32 channelId) {
   //
   // Free channel buffers.
   //
+  unmapVMBusChannelRingMirror(&channel->txMirrorDesc, &channel->txMirrorMap, &channel->txMirror);
+  unmapVMBusChannelRingMirror(&channel->rxMirrorDesc, &channel->rxMirrorMap, &channel->rxMirror);
   channel->txBuffer    = nullptr;
   channel->rxBuffer    = nullptr;
   channel->rxPageIndex = 0;
@@ -177,20 +214,48 @@ IOReturn HyperVVMBus::closeVMBusChannel(UInt32 channelId) {
   return kIOReturnSuccess;
 }
 
+UInt32 HyperVVMBus::getGPADLPFNs(HyperVDMABuffer *dmaBuffer, UInt64 *offset, UInt64 *pfns, UInt32 pfnCount) {
+  IOPhysicalAddress64 physAddr;
+  IOByteCount         segmentLength;
+  UInt32              count = 0;
+
+  //
+  // Walk the physical segments of the buffer starting at the specified offset.
+  // Buffers without a memory descriptor are assumed to be physically contiguous.
+  //
+  while (count < pfnCount && *offset < dmaBuffer->size) {
+    if (dmaBuffer->bufDesc != nullptr) {
+#if __MAC_OS_X_VERSION_MIN_REQUIRED < __MAC_10_6
+      physAddr = dmaBuffer->bufDesc->getPhysicalSegment64(*offset, &segmentLength);
+#else
+      physAddr = dmaBuffer->bufDesc->getPhysicalSegment(*offset, &segmentLength, kIOMemoryMapperNone);
+#endif
+      if (physAddr == 0 || segmentLength == 0) {
+        HVSYSLOG("Failed to get physical segment at offset 0x%llX", *offset);
+        break;
+      }
+    } else {
+      physAddr      = dmaBuffer->physAddr + *offset;
+      segmentLength = dmaBuffer->size - *offset;
+    }
+
+    //
+    // Segments are page-aligned as the buffer itself is page-aligned.
+    //
+    while (count < pfnCount && segmentLength >= PAGE_SIZE) {
+      pfns[count++]  = physAddr >> PAGE_SHIFT;
+      physAddr      += PAGE_SIZE;
+      segmentLength -= PAGE_SIZE;
+      *offset       += PAGE_SIZE;
+    }
+  }
+
+  return count;
+}
+
 IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle) {
-  bool result;
-  
-  UInt32 pageCount;
-  UInt32 pfnSize;
-  UInt32 pageHeaderCount;
-  UInt32 messageSize;
-  UInt64 physPageIndex;
-  UInt32 pagesRemaining;
-  UInt32 pagesBodyCount;
-  bool needsMultipleMessages;
-  
-  VMBusChannelMessageGPADLHeader  *gpadlHeader;
-  VMBusChannelMessageGPADLBody    *gpadlBody;
+  IOReturn                        status;
+  UInt32                          pageCount;
   VMBusChannelMessageGPADLCreated gpadlCreated;
   
   //
@@ -211,7 +276,7 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
   //
   pageCount = (UInt32)(dmaBuffer->size >> PAGE_SHIFT);
   if (pageCount > kHyperVMaxGpadlPages) {
-    HVDBGLOG("%u is above the maximum supported number of GPADL pages");
+    HVDBGLOG("%u is above the maximum supported number of GPADL pages", pageCount);
     return kIOReturnBadArgument;
   }
   
@@ -221,114 +286,111 @@ IOReturn HyperVVMBus::initVMBusChannelGPADL(UInt32 channelId, HyperVDMABuffer *d
   *gpadlHandle = OSIncrementAtomic(&_nextGpadlHandle);
   
   //
-  // For larger GPADL requests, a GPADL header and one or more GPADL body messages are required.
-  // Otherwise we can use just the GPADL header.
+  // Post all GPADL messages and wait for the creation response in a single gated action.
   //
-  pfnSize = kHyperVMessageDataSize - sizeof (VMBusChannelMessageGPADLHeader) - sizeof (HyperVGPARange);
-  pageHeaderCount = pfnSize / sizeof (UInt64);
-  needsMultipleMessages = pageCount > pageHeaderCount;
-  HVDBGLOG("Configuring GPADL handle 0x%X for channel %u of %u pages, multiple messages: %u",
-           *gpadlHandle, channelId, pageCount, needsMultipleMessages);
+  hvController->recordTimeline(channelId, kHyperVTimelinePhaseGPADLCreate, kHyperVTimelineEventBegin);
+  status = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::initVMBusChannelGPADLGated),
+                               &channelId, dmaBuffer, gpadlHandle, &gpadlCreated);
+  if (status == kIOReturnSuccess) {
+    HVDBGLOG("GPADL creation response for channel %u: 0x%X", channelId, gpadlCreated.status);
+    if (gpadlCreated.status != kHyperVStatusSuccess) {
+      HVSYSLOG("Failed to create GPADL for channel %u", channelId);
+      status = kIOReturnIOError;
+    }
+  }
+  
+  hvController->recordTimeline(channelId, kHyperVTimelinePhaseGPADLCreate,
+                               status == kIOReturnSuccess ? kHyperVTimelineEventEnd : kHyperVTimelineEventFailed);
+  return status;
+}
+
+IOReturn HyperVVMBus::initVMBusChannelGPADLGated(UInt32 *channelId, HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle,
+                                                 VMBusChannelMessageGPADLCreated *gpadlCreated) {
+  IOReturn           status;
+  VMBusMessageWaiter *waiter;
+  
+  UInt32 pageCount;
+  UInt32 pageHeaderCount;
+  UInt32 messageSize;
+  UInt64 bufferOffset = 0;
+  UInt32 pagesRemaining;
+  UInt32 pagesBodyCount;
+  
+  VMBusChannelMessageGPADLHeader  *gpadlHeader = (VMBusChannelMessageGPADLHeader*) _gpadlMessageBuffer;
+  VMBusChannelMessageGPADLBody    *gpadlBody   = (VMBusChannelMessageGPADLBody*) _gpadlMessageBuffer;
   
   //
-  // Create GPADL header message.
+  // For larger GPADL requests, a GPADL header and one or more GPADL body messages are required.
+  // Otherwise we can use just the GPADL header.
+  //
+  // All messages are built in the same buffer, which is protected by the command gate. The hypercall
+  // copies each message into the per-CPU post message page, so the buffer can be reused immediately.
   //
-  messageSize = sizeof (VMBusChannelMessageGPADLHeader) + sizeof (HyperVGPARange) + (pageHeaderCount * sizeof (UInt64));
-  gpadlHeader = (VMBusChannelMessageGPADLHeader*) IOMalloc(messageSize);
-  if (gpadlHeader == nullptr) {
-    HVSYSLOG("Failed to allocate GPADL header message for channel %u", channelId);
-    return kIOReturnNoResources;
+  pageCount       = (UInt32)(dmaBuffer->size >> PAGE_SHIFT);
+  pageHeaderCount = (UInt32)((kHyperVMessageDataSize - sizeof (VMBusChannelMessageGPADLHeader) - sizeof (HyperVGPARange)) / sizeof (UInt64));
+  if (pageHeaderCount > pageCount) {
+    pageHeaderCount = pageCount;
   }
-  bzero(gpadlHeader, messageSize);
+  HVDBGLOG("Configuring GPADL handle 0x%X for channel %u of %u pages, multiple messages: %u",
+           *gpadlHandle, *channelId, pageCount, pageCount > pageHeaderCount);
   
   //
   // Header will contain the first batch of GPADL PFNs.
   //
+  messageSize = (UInt32) (sizeof (VMBusChannelMessageGPADLHeader) + sizeof (HyperVGPARange) + (pageHeaderCount * sizeof (UInt64)));
+  bzero(gpadlHeader, messageSize);
   gpadlHeader->header.type         = kVMBusChannelMessageTypeGPADLHeader;
-  gpadlHeader->channelId           = channelId;
+  gpadlHeader->channelId           = *channelId;
   gpadlHeader->gpadl               = *gpadlHandle;
   gpadlHeader->rangeCount          = kHyperVGpadlRangeCount;
   gpadlHeader->rangeBufferLength   = sizeof (HyperVGPARange) + (pageCount * sizeof (UInt64)); // Max page count is 8190.
   gpadlHeader->range[0].byteOffset = 0;
   gpadlHeader->range[0].byteCount  = (UInt32)dmaBuffer->size;
 
-  physPageIndex = dmaBuffer->physAddr >> PAGE_SHIFT;
-  for (UInt32 i = 0; i < pageHeaderCount; i++) {
-    gpadlHeader->range[0].pfnArray[i] = physPageIndex;
-    physPageIndex++;
+  if (getGPADLPFNs(dmaBuffer, &bufferOffset, gpadlHeader->range[0].pfnArray, pageHeaderCount) != pageHeaderCount) {
+    HVSYSLOG("Failed to get GPADL header pages for channel %u", *channelId);
+    return kIOReturnDMAError;
   }
   
-  //
-  // Send GPADL header message.
-  // If there are multiple messages required, wait for response after the last one.
-  //
-  if (needsMultipleMessages) {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize);
-  } else {
-    result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlHeader, messageSize,
-                                      kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
-  }
-  IOFree(gpadlHeader, messageSize);
-  if (!result) {
-    HVSYSLOG("Failed to send GPADL header message for channel %u", channelId);
-    return kIOReturnIOError; // TODO:
+  waiter = acquireVMBusMessageWaiterGated(kVMBusChannelMessageTypeGPADLCreated, *gpadlHandle);
+  status = postVMBusMessageGated((VMBusChannelMessage*) gpadlHeader, messageSize);
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Failed to send GPADL header message for channel %u", *channelId);
+    releaseVMBusMessageWaiterGated(waiter);
+    return status;
   }
   
-  if (needsMultipleMessages) {
-    //
-    // Send rest of GPADL pages as body messages.
-    //
-    pagesRemaining = pageCount - pageHeaderCount;
-    while (pagesRemaining > 0) {
-      if (pagesRemaining > kHyperVMaxGpadlBodyPfns) {
-        pagesBodyCount = kHyperVMaxGpadlBodyPfns;
-      } else {
-        pagesBodyCount = pagesRemaining;
-      }
-      
-      messageSize = (UInt32) (sizeof (VMBusChannelMessageGPADLBody) + (pagesBodyCount * sizeof (UInt64)));
-      gpadlBody = (VMBusChannelMessageGPADLBody*) IOMalloc(messageSize);
-      if (gpadlBody == nullptr) {
-        HVSYSLOG("Failed to allocate GPADL body message for channel %u", channelId);
-        return kIOReturnNoResources;
-      }
-      bzero(gpadlBody, messageSize);
-      
-      gpadlBody->header.type = kVMBusChannelMessageTypeGPADLBody;
-      gpadlBody->gpadl       = *gpadlHandle;
-      for (UInt32 i = 0; i < pagesBodyCount; i++) {
-        gpadlBody->pfn[i] = physPageIndex;
-        physPageIndex++;
-      }
-      
-      HVDBGLOG("Processed %u body pages for for channel %u, %u remaining", pagesBodyCount, channelId, pagesRemaining);
-      pagesRemaining -= pagesBodyCount;
-      
-      //
-      // Send body message.
-      // For the last one, we want to wait for the creation response.
-      //
-      if (pagesRemaining == 0) {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize,
-                                          kVMBusChannelMessageTypeGPADLCreated, (VMBusChannelMessage*) &gpadlCreated);
-      } else {
-        result = sendVMBusMessageWithSize((VMBusChannelMessage*) gpadlBody, messageSize);
-      }
-
-      IOFree(gpadlBody, messageSize);
-      if (!result) {
-        HVSYSLOG("Failed to send GPADL body message for channel %u", channelId);
-        return kIOReturnIOError;
-      }
+  //
+  // Send rest of GPADL pages as body messages, back-to-back.
+  //
+  pagesRemaining = pageCount - pageHeaderCount;
+  while (pagesRemaining > 0) {
+    pagesBodyCount = pagesRemaining > kHyperVMaxGpadlBodyPfns ? kHyperVMaxGpadlBodyPfns : pagesRemaining;
+    messageSize    = (UInt32) (sizeof (VMBusChannelMessageGPADLBody) + (pagesBodyCount * sizeof (UInt64)));
+    
+    gpadlBody->header.type     = kVMBusChannelMessageTypeGPADLBody;
+    gpadlBody->header.reserved = 0;
+    gpadlBody->messageNumber   = 0;
+    gpadlBody->gpadl           = *gpadlHandle;
+    if (getGPADLPFNs(dmaBuffer, &bufferOffset, gpadlBody->pfn, pagesBodyCount) != pagesBodyCount) {
+      HVSYSLOG("Failed to get GPADL body pages for channel %u", *channelId);
+      releaseVMBusMessageWaiterGated(waiter);
+      return kIOReturnDMAError;
     }
+    
+    status = postVMBusMessageGated((VMBusChannelMessage*) gpadlBody, messageSize);
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Failed to send GPADL body message for channel %u", *channelId);
+      releaseVMBusMessageWaiterGated(waiter);
+      return status;
+    }
+    pagesRemaining -= pagesBodyCount;
   }
   
-  HVDBGLOG("GPADL creation response for channel %u: 0x%X", channelId, gpadlCreated.status);
-  if (gpadlCreated.status != kHyperVStatusSuccess) {
-    HVSYSLOG("Failed to create GPADL for channel %u", channelId);
-    return kIOReturnIOError;
-  }
-  
+  //
+  // Wait once for the creation response after the last message.
+  //
+  waitVMBusMessageGated(waiter, (VMBusChannelMessage*) gpadlCreated);
   return kIOReturnSuccess;
 }
 
@@ -363,6 +425,15 @@ IOReturn HyperVVMBus::freeVMBusChannelGPADL(UInt32 channelId, UInt32 gpadlHandle
 void HyperVVMBus::signalVMBusChannel(UInt32 channelId) {
   VMBusChannel *channel = &_vmbusChannels[channelId];
 
+  //
+  // Channels that are not latency sensitive set their monitor trigger bit, and are picked up
+  // the next time Hyper-V polls the monitor page. This avoids a hypercall for each signal.
+  //
+  if (channel->useMonitor && !channel->lowLatency) {
+    sync_set_bit(channel->monitorBit, &_vmbusMonitorPage->triggerGroups[channel->monitorGroup].pending);
+    return;
+  }
+
   //
   // Signal Hyper-V the specified channel has data waiting on the TX ring.
   // Set bit for channel if a dedicated interrupt is not being used.
@@ -377,3 +448,376 @@ void HyperVVMBus::signalVMBusChannel(UInt32 channelId) {
              channelId, channel->connectionSignalId, status);
   }
 }
+
+//
+// Device types that benefit from spreading interrupts across CPUs.
+//
+static const char *VMBusHighThroughputDeviceTypes[] = {
+  "f8615163-df3e-46c5-913f-f2d2f965ed0e", // Network
+  "ba6163d9-04a1-4d29-b605-72e2ffb1dc7f", // SCSI storage
+  "32412632-86cb-44a2-9b5c-50d1417354f5", // IDE storage
+  "44c4f61d-4444-4400-9d52-802e27ede19f"  // PCI passthrough
+};
+
+void HyperVVMBus::initVMBusChannelCPUPolicy() {
+  UInt32 policy;
+
+  //
+  // Policy can be overridden with hvvmbuscpu=<policy>, -hvvmbusnocpu targets all channels at CPU 0.
+  //
+  if (lilu_get_boot_args("hvvmbuscpu", &policy, sizeof (policy))) {
+    if (policy < kVMBusChannelCPUPolicyMax) {
+      _channelCPUPolicy = static_cast<VMBusChannelCPUPolicy>(policy);
+    } else {
+      HVSYSLOG("Invalid channel CPU policy %u", policy);
+    }
+  }
+  _channelCPUTargeting = !checkKernelArgument("-hvvmbusnocpu");
+  HVDBGLOG("Channel CPU targeting %s, policy %u", _channelCPUTargeting ? "enabled" : "disabled", _channelCPUPolicy);
+
+  //
+  // CPU 0 also handles VMBus management messages, start spreading channels on the next CPU.
+  //
+  _nextChannelCPU = 1;
+}
+
+UInt32 HyperVVMBus::selectVMBusChannelTargetCPU(UInt32 channelId) {
+  VMBusChannel *channel = &_vmbusChannels[channelId];
+  UInt32       cpuCount = hvController->getCPUCount();
+  bool         spread;
+
+  //
+  // Targeting CPUs other than 0 requires Windows Server 2012 / Windows 8 or newer, and the VP index
+  // for each CPU to be known.
+  //
+  if (!_channelCPUTargeting || _vmbusVersion < kVMBusVersionWIN8
+      || !hvController->isVirtualCPUIndexSupported() || cpuCount <= 1) {
+    return 0;
+  }
+
+  //
+  // Device requested CPU takes priority over the policy.
+  //
+  if (channel->hasRequestedCpu && channel->requestedCpu < cpuCount) {
+    return channel->requestedCpu;
+  }
+
+  switch (_channelCPUPolicy) {
+    case kVMBusChannelCPUPolicyRoundRobin:
+      spread = true;
+      break;
+
+    case kVMBusChannelCPUPolicyByType:
+      spread = false;
+      for (UInt32 i = 0; i < arrsize(VMBusHighThroughputDeviceTypes); i++) {
+        if (strcmp(channel->typeGuidString, VMBusHighThroughputDeviceTypes[i]) == 0) {
+          spread = true;
+          break;
+        }
+      }
+      break;
+
+    default:
+      spread = false;
+      break;
+  }
+
+  return spread ? (__sync_fetch_and_add(&_nextChannelCPU, 1) % cpuCount) : 0;
+}
+
+IOReturn HyperVVMBus::setVMBusChannelTargetCPU(UInt32 channelId, UInt32 cpu) {
+  if (channelId == 0 || channelId >= kVMBusMaxChannels) {
+    return kIOReturnBadArgument;
+  }
+  if (cpu != kVMBusChannelTargetCPUAny && cpu >= hvController->getCPUCount()) {
+    return kIOReturnBadArgument;
+  }
+
+  //
+  // Takes effect the next time the channel is opened.
+  //
+  _vmbusChannels[channelId].hasRequestedCpu = cpu != kVMBusChannelTargetCPUAny;
+  _vmbusChannels[channelId].requestedCpu    = cpu;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBus::setVMBusChannelLowLatency(UInt32 channelId, bool lowLatency) {
+  if (channelId == 0 || channelId >= kVMBusMaxChannels) {
+    return kIOReturnBadArgument;
+  }
+
+  _vmbusChannels[channelId].lowLatency = lowLatency;
+  HVDBGLOG("Channel %u low latency signaling %s (monitor %s)", channelId,
+           lowLatency ? "enabled" : "disabled", _vmbusChannels[channelId].useMonitor ? "available" : "unavailable");
+  return kIOReturnSuccess;
+}
+
+UInt32 HyperVVMBus::getVMBusChannelTargetCPU(UInt32 channelId) {
+  if (channelId == 0 || channelId >= kVMBusMaxChannels) {
+    return 0;
+  }
+  return _vmbusChannels[channelId].targetCpu;
+}
+
+bool HyperVVMBus::initSharedWorkLoops() {
+  //
+  // Shared work loops can be disabled with -hvvmbusnoshared, all devices then use dedicated work loops.
+  //
+  _sharedWorkLoopsEnabled = !checkKernelArgument("-hvvmbusnoshared");
+  if (!_sharedWorkLoopsEnabled) {
+    HVDBGLOG("Shared work loops are disabled");
+    return true;
+  }
+
+  _sharedWorkLoopsLock = IOLockAlloc();
+  if (_sharedWorkLoopsLock == nullptr) {
+    HVSYSLOG("Failed to allocate shared work loop lock");
+    return false;
+  }
+
+  _sharedWorkLoopsCount = hvController->getCPUCount();
+  if (_sharedWorkLoopsCount == 0) {
+    _sharedWorkLoopsCount = 1;
+  }
+  _sharedWorkLoops = static_cast<IOWorkLoop **>(IOMalloc(sizeof (*_sharedWorkLoops) * _sharedWorkLoopsCount));
+  if (_sharedWorkLoops == nullptr) {
+    HVSYSLOG("Failed to allocate shared work loops");
+    return false;
+  }
+  bzero(_sharedWorkLoops, sizeof (*_sharedWorkLoops) * _sharedWorkLoopsCount);
+
+  HVDBGLOG("Initialized %u shared work loops", _sharedWorkLoopsCount);
+  return true;
+}
+
+void HyperVVMBus::freeSharedWorkLoops() {
+  //
+  // Devices hold their own references to the shared work loops, only the pool references are dropped here.
+  //
+  if (_sharedWorkLoops != nullptr) {
+    for (UInt32 i = 0; i < _sharedWorkLoopsCount; i++) {
+      OSSafeReleaseNULL(_sharedWorkLoops[i]);
+    }
+    IOFree(_sharedWorkLoops, sizeof (*_sharedWorkLoops) * _sharedWorkLoopsCount);
+    _sharedWorkLoops = nullptr;
+  }
+  _sharedWorkLoopsCount = 0;
+
+  if (_sharedWorkLoopsLock != nullptr) {
+    IOLockFree(_sharedWorkLoopsLock);
+    _sharedWorkLoopsLock = nullptr;
+  }
+}
+
+IOWorkLoop *HyperVVMBus::copySharedWorkLoop(UInt32 channelId) {
+  VMBusChannel *channel;
+  UInt32       index;
+  IOWorkLoop   *workLoop;
+
+  if (!_sharedWorkLoopsEnabled || channelId == 0 || channelId >= kVMBusMaxChannels) {
+    return nullptr;
+  }
+  channel = &_vmbusChannels[channelId];
+
+  //
+  // Work loop is chosen before the channel is opened, use the CPU requested by the device if any.
+  // Otherwise, spread channels across the pool by channel ID, as interrupts for all of them are targeted at
+  // CPU 0 by default and would otherwise all be serialized on a single work loop.
+  //
+  index = (channel->hasRequestedCpu ? channel->requestedCpu : channelId) % _sharedWorkLoopsCount;
+
+  IOLockLock(_sharedWorkLoopsLock);
+  workLoop = _sharedWorkLoops[index];
+  if (workLoop == nullptr) {
+    workLoop = IOWorkLoop::workLoop();
+    if (workLoop == nullptr) {
+      HVSYSLOG("Failed to initialize shared work loop %u", index);
+      IOLockUnlock(_sharedWorkLoopsLock);
+      return nullptr;
+    }
+    _sharedWorkLoops[index] = workLoop;
+    HVDBGLOG("Created shared work loop %u", index);
+  }
+
+  //
+  // Pool keeps its own reference until the VMBus is freed.
+  //
+  workLoop->retain();
+  IOLockUnlock(_sharedWorkLoopsLock);
+
+  HVDBGLOG("Channel %u is using shared work loop %u", channelId, index);
+  return workLoop;
+}
+
+UInt8 *HyperVVMBus::mapVMBusChannelRingMirror(VMBusChannel *channel, UInt32 ringOffset, UInt32 ringSize,
+                                              IOMemoryDescriptor **mirrorDesc, IOMemoryMap **mirrorMap) {
+#if __MAC_OS_X_VERSION_MIN_REQUIRED >= __MAC_10_6
+  IOMemoryDescriptor      *ringDesc;
+  IOMemoryDescriptor      *ringDescs[2];
+  IOMultiMemoryDescriptor *multiDesc;
+  IOMemoryMap             *map;
+  volatile UInt32         *ringData;
+  volatile UInt32         *mirror;
+  bool                    isMirrored;
+
+  //
+  // Create a descriptor describing the ring buffer data pages twice,
+  // then map it into a single virtually contiguous range.
+  //
+  if (channel->dataBuffer.bufDesc == nullptr) {
+    HVDBGLOG("Ring buffer has no memory descriptor");
+    return nullptr;
+  }
+  ringDesc = IOSubMemoryDescriptor::withSubRange(channel->dataBuffer.bufDesc, ringOffset, ringSize, kIODirectionInOut);
+  if (ringDesc == nullptr) {
+    HVDBGLOG("Failed to create ring buffer sub-descriptor");
+    return nullptr;
+  }
+
+  ringDescs[0] = ringDesc;
+  ringDescs[1] = ringDesc;
+  multiDesc = IOMultiMemoryDescriptor::withDescriptors(ringDescs, arrsize(ringDescs), kIODirectionInOut, false);
+  ringDesc->release();
+  if (multiDesc == nullptr) {
+    HVDBGLOG("Failed to create ring buffer mirror descriptor");
+    return nullptr;
+  }
+
+  if (multiDesc->prepare() != kIOReturnSuccess) {
+    HVDBGLOG("Failed to prepare ring buffer mirror descriptor");
+    multiDesc->release();
+    return nullptr;
+  }
+
+  map = multiDesc->createMappingInTask(kernel_task, 0, kIOMapAnywhere | kIOMapDefaultCache);
+  if (map == nullptr) {
+    HVDBGLOG("Failed to map ring buffer mirror");
+    multiDesc->complete();
+    multiDesc->release();
+    return nullptr;
+  }
+
+  //
+  // Ensure both halves of the mapping actually alias the ring buffer data.
+  // Hyper-V does not access the ring buffers until the channel is opened.
+  //
+  ringData = (volatile UInt32*) (((UInt8*) channel->dataBuffer.buffer) + ringOffset);
+  mirror   = (volatile UInt32*) map->getVirtualAddress();
+
+  *ringData  = 0x52494E47;
+  isMirrored = mirror[0] == 0x52494E47 && mirror[ringSize / sizeof (UInt32)] == 0x52494E47;
+  *ringData  = 0;
+
+  if (!isMirrored) {
+    HVSYSLOG("Ring buffer mirror mapping does not alias ring buffer data");
+    map->release();
+    multiDesc->complete();
+    multiDesc->release();
+    return nullptr;
+  }
+
+  *mirrorDesc = multiDesc;
+  *mirrorMap  = map;
+  return (UInt8*) mirror;
+#else
+  //
+  // Not supported on older systems, wraparound is handled by the device nub.
+  //
+  return nullptr;
+#endif
+}
+
+void HyperVVMBus::unmapVMBusChannelRingMirror(IOMemoryDescriptor **mirrorDesc, IOMemoryMap **mirrorMap, UInt8 **mirror) {
+  *mirror = nullptr;
+  OSSafeReleaseNULL(*mirrorMap);
+  if (*mirrorDesc != nullptr) {
+    (*mirrorDesc)->complete();
+    OSSafeReleaseNULL(*mirrorDesc);
+  }
+}
+
+IOReturn HyperVVMBus::getVMBusSubChannelCountGated(UInt32 *primaryChannelId, UInt32 *count) {
+  *count = 0;
+  for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+    if (_vmbusChannels[i].primaryChannelId == *primaryChannelId && _vmbusChannels[i].status != kVMBusChannelStatusNotPresent
+        && _vmbusChannels[i].deviceNub != nullptr) {
+      (*count)++;
+    }
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBus::waitForVMBusSubChannelsGated(UInt32 *primaryChannelId, UInt32 *count, AbsoluteTime *deadline) {
+  int    result = THREAD_AWAKENED;
+  UInt32 subChannelCount;
+
+  //
+  // Sub-channel offers are processed under the command gate, which is released while sleeping.
+  //
+  while (true) {
+    getVMBusSubChannelCountGated(primaryChannelId, &subChannelCount);
+    if (subChannelCount >= *count) {
+      return kIOReturnSuccess;
+    }
+    if (result == THREAD_TIMED_OUT) {
+      return kIOReturnTimeout;
+    }
+    result = _cmdGate->commandSleep(&_vmbusChannels[*primaryChannelId], *deadline, THREAD_UNINT);
+  }
+}
+
+IOReturn HyperVVMBus::copyVMBusSubChannelGated(UInt32 *primaryChannelId, UInt32 *index, HyperVVMBusDevice **device) {
+  UInt32 subIndex = 0;
+
+  //
+  // Sub-channels are returned in channel ID order.
+  //
+  for (UInt32 i = 1; i < kVMBusMaxChannels; i++) {
+    if (_vmbusChannels[i].primaryChannelId != *primaryChannelId || _vmbusChannels[i].status == kVMBusChannelStatusNotPresent
+        || _vmbusChannels[i].deviceNub == nullptr) {
+      continue;
+    }
+    if (subIndex++ == *index) {
+      *device = _vmbusChannels[i].deviceNub;
+      (*device)->retain();
+      return kIOReturnSuccess;
+    }
+  }
+  return kIOReturnNotFound;
+}
+
+UInt32 HyperVVMBus::getVMBusSubChannelCount(UInt32 primaryChannelId) {
+  UInt32 count = 0;
+
+  if (primaryChannelId == 0 || primaryChannelId >= kVMBusMaxChannels) {
+    return 0;
+  }
+  _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::getVMBusSubChannelCountGated),
+                      &primaryChannelId, &count);
+  return count;
+}
+
+IOReturn HyperVVMBus::waitForVMBusSubChannels(UInt32 primaryChannelId, UInt32 count, UInt32 timeoutMs) {
+  AbsoluteTime deadline;
+
+  if (primaryChannelId == 0 || primaryChannelId >= kVMBusMaxChannels) {
+    return kIOReturnBadArgument;
+  }
+
+  clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+  return _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::waitForVMBusSubChannelsGated),
+                             &primaryChannelId, &count, &deadline);
+}
+
+HyperVVMBusDevice *HyperVVMBus::copyVMBusSubChannel(UInt32 primaryChannelId, UInt32 index) {
+  HyperVVMBusDevice *device = nullptr;
+
+  if (primaryChannelId == 0 || primaryChannelId >= kVMBusMaxChannels) {
+    return nullptr;
+  }
+  if (_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBus::copyVMBusSubChannelGated),
+                          &primaryChannelId, &index, &device) != kIOReturnSuccess) {
+    return nullptr;
+  }
+  return device;
+}
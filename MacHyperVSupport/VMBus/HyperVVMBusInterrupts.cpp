@@ -7,6 +7,16 @@
 
 #include "HyperVVMBus.hpp"
 
+//
+// Size of per-CPU VMBus message queue, must be a power of 2.
+//
+#define kVMBusMessageQueueSize  64
+
+//
+// VMBus management messages are copied out of the SynIC message slot in interrupt context on the
+// CPU that received them, allowing end-of-message to be signaled immediately on that CPU.
+// Messages are then processed on the work loop from a single-producer, single-consumer queue per CPU.
+//
 class VMBusInterruptProcessor : public OSObject {
   OSDeclareDefaultStructors(VMBusInterruptProcessor)
   
@@ -14,6 +24,11 @@ private:
   UInt32                  _cpuIndex              = 0;
   HyperVVMBus             *_vmbus                = nullptr;
   IOInterruptEventSource  *_interruptEventSource = nullptr;
+
+  HyperVMessage           *_messageQueue         = nullptr;
+  volatile UInt32         _messageQueueHead      = 0;
+  volatile UInt32         _messageQueueTail      = 0;
+  volatile bool           _messageQueueOverflow  = false;
   
   void handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count);
   
@@ -23,10 +38,15 @@ public:
   bool setupInterrupt();
   void teardownInterrupt();
   void triggerInterrupt();
+  void queuePendingMessage();
 };
 
 OSDefineMetaClassAndStructors(VMBusInterruptProcessor, OSObject);
 
+extern "C" void queuePendingMessageOnCPU(void *vmbusInterruptProcessor) {
+  static_cast<VMBusInterruptProcessor*>(vmbusInterruptProcessor)->queuePendingMessage();
+}
+
 VMBusInterruptProcessor *VMBusInterruptProcessor::vmbusInterruptProcessor(UInt32 cpuIndex, HyperVVMBus *vmbus) {
   VMBusInterruptProcessor *me = new VMBusInterruptProcessor;
   if (me == nullptr) {
@@ -39,8 +59,15 @@ VMBusInterruptProcessor *VMBusInterruptProcessor::vmbusInterruptProcessor(UInt32
 }
 
 bool VMBusInterruptProcessor::setupInterrupt() {
+  _messageQueue = IONew(HyperVMessage, kVMBusMessageQueueSize);
+  if (_messageQueue == nullptr) {
+    return false;
+  }
+
   _interruptEventSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventAction, this, &VMBusInterruptProcessor::handleInterrupt));
   if (_interruptEventSource == nullptr) {
+    IODelete(_messageQueue, HyperVMessage, kVMBusMessageQueueSize);
+    _messageQueue = nullptr;
     return false;
   }
   _interruptEventSource->enable();
@@ -52,21 +79,85 @@ void VMBusInterruptProcessor::teardownInterrupt() {
   _vmbus->getWorkLoop()->removeEventSource(_interruptEventSource);
   _interruptEventSource->disable();
   _interruptEventSource->release();
+
+  if (_messageQueue != nullptr) {
+    IODelete(_messageQueue, HyperVMessage, kVMBusMessageQueueSize);
+    _messageQueue = nullptr;
+  }
 }
 
 void VMBusInterruptProcessor::triggerInterrupt() {
   _interruptEventSource->interruptOccurred(0, 0, 0);
 }
 
+void VMBusInterruptProcessor::queuePendingMessage() {
+  HyperVController *hvController = _vmbus->getHvController();
+  HyperVMessage    *vmbusMessage;
+  UInt32           tail;
+
+  //
+  // Must be running on the CPU that owns this queue with interrupts disabled.
+  //
+  if ((UInt32) cpu_number() != _cpuIndex) {
+    return;
+  }
+
+  //
+  // Sometimes the interrupt will fire for the same message, and by the time this
+  // is invoked for that second interrupt, the message will be cleared.
+  //
+  vmbusMessage = hvController->getPendingMessage(_cpuIndex, kVMBusInterruptMessage);
+  if (vmbusMessage->type == kHyperVMessageTypeNone) {
+    return;
+  }
+
+  //
+  // If the queue is full, leave the message in the slot. Hyper-V holds any further messages
+  // until end-of-message is signaled, and the work loop will requeue it once there is space.
+  //
+  tail = _messageQueueTail;
+  if (tail - _messageQueueHead >= kVMBusMessageQueueSize) {
+    _messageQueueOverflow = true;
+    triggerInterrupt();
+    return;
+  }
+
+  memcpy(&_messageQueue[tail & (kVMBusMessageQueueSize - 1)], vmbusMessage, sizeof (*vmbusMessage));
+  __sync_synchronize();
+  _messageQueueTail = tail + 1;
+
+  hvController->completePendingMessage(_cpuIndex, kVMBusInterruptMessage);
+  triggerInterrupt();
+}
+
 void VMBusInterruptProcessor::handleInterrupt(OSObject *owner, IOInterruptEventSource *sender, int count) {
+  UInt32 head = _messageQueueHead;
+
+  //
+  // Process queued messages on main VMBus class.
   //
-  // Process message on main VMBus class.
+  while (head != _messageQueueTail) {
+    __sync_synchronize();
+    _vmbus->processIncomingVMBusMessage(_cpuIndex, &_messageQueue[head & (kVMBusMessageQueueSize - 1)]);
+
+    head++;
+    __sync_synchronize();
+    _messageQueueHead = head;
+  }
+
   //
-  _vmbus->processIncomingVMBusMessage(_cpuIndex);
+  // Requeue any message left in the slot due to a full queue.
+  // This can only be done on the receiving CPU, which is rare enough that a rendezvous is acceptable.
+  //
+  if (_messageQueueOverflow) {
+    _messageQueueOverflow = false;
+    __sync_synchronize();
+    mp_rendezvous_no_intrs(queuePendingMessageOnCPU, this);
+  }
 }
 
 void HyperVVMBus::handleDirectInterrupt(OSObject *target, void *refCon, IOService *nub, int source) {
-  vmbusInterruptProcs[cpu_number()]->triggerInterrupt();
+  vmbusInterruptProcs[cpu_number()]->queuePendingMessage();
 }
 
 bool HyperVVMBus::allocateInterruptEventSources() {
@@ -79,8 +170,10 @@ bool HyperVVMBus::allocateInterruptEventSources() {
     if (vmbusInterruptProcessor == nullptr) {
       return false;
     }
-    vmbusInterruptProcessor->setupInterrupt();
     vmbusInterruptProcs[cpuIndex] = vmbusInterruptProcessor;
+    if (!vmbusInterruptProcessor->setupInterrupt()) {
+      return false;
+    }
   }
   
   if (registerInterrupt(0, this, OSMemberFunctionCast(IOInterruptAction, this, &HyperVVMBus::handleDirectInterrupt)) != kIOReturnSuccess
@@ -22,6 +22,12 @@ bool HyperVVMBus::allocateVMBusBuffers() {
   //
   vmbusRxEventFlags = (HyperVEventFlags*)vmbusEventFlags.buffer;
   vmbusTxEventFlags = (HyperVEventFlags*)((UInt8*)vmbusEventFlags.buffer + PAGE_SIZE / 2);
+
+  //
+  // Second monitor page is used for guest to host signaling.
+  //
+  _vmbusMonitorPage      = (HyperVMonitorPage*) _vmbusMnf2.buffer;
+  _vmbusMonitorSignaling = !checkKernelArgument("-hvvmbusnomnf");
   
   return true;
 }
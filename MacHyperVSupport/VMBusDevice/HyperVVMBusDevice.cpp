@@ -7,6 +7,8 @@
 
 #include "HyperVVMBusDevice.hpp"
 
+#include <kern/thread.h>
+
 OSDefineMetaClassAndStructors(HyperVVMBusDevice, super);
 
 bool HyperVVMBusDevice::attach(IOService *provider) {
@@ -39,20 +41,13 @@ bool HyperVVMBusDevice::attach(IOService *provider) {
 
   do {
     //
-    // Initialize work loop and command gate.
+    // Work loop and command gate are created on first use.
     //
-    _workLoop = IOWorkLoop::workLoop();
-    if (_workLoop == nullptr) {
-      HVSYSLOG("Failed to initialize work loop");
-      break;
-    }
-    
-    _commandGate = IOCommandGate::commandGate(this);
-    if (_commandGate == nullptr) {
-      HVSYSLOG("Failed to initialize command gate");
+    _workLoopLock = IOLockAlloc();
+    if (_workLoopLock == nullptr) {
+      HVSYSLOG("Failed to allocate work loop lock");
       break;
     }
-    _workLoop->addEventSource(_commandGate);
     
     //
     // Get channel number and GUID properties.
@@ -74,6 +69,19 @@ bool HyperVVMBusDevice::attach(IOService *provider) {
     HVDBGLOG("Attaching nub type %s for channel %u", _typeId, _channelId);
     memcpy(_instanceId, instanceBytes->getBytesNoCopy(), instanceBytes->getLength());
     
+    //
+    // Sub-channels hold a reference to their primary channel nub until freed, and share its work loop.
+    // The primary channel nub is always registered before any of its sub-channels are offered.
+    //
+    if (getProperty(kHyperVVMBusDeviceSubChannelIndexKey) != nullptr) {
+      _primaryChannel = _vmbusProvider->_vmbusChannels[_vmbusProvider->_vmbusChannels[_channelId].primaryChannelId].deviceNub;
+      if (_primaryChannel == nullptr) {
+        HVSYSLOG("Primary channel for sub-channel %u is not present", _channelId);
+        break;
+      }
+      _primaryChannel->retain();
+    }
+    
     //
     // Set location to ensure unique names in I/O Registry.
     //
@@ -91,8 +99,26 @@ bool HyperVVMBusDevice::attach(IOService *provider) {
     setProperty("built-in", builtInData);
     builtInData->release();
 
-    _vmbusRequestsLock = IOLockAlloc();
-    _vmbusTransLock    = IOLockAlloc();
+    _vmbusTransLock            = IOLockAlloc();
+    _vmbusRequestsOverflowLock = IOSimpleLockAlloc();
+    _txLock                    = IOSimpleLockAlloc();
+    _rxLock                    = IOLockAlloc();
+    if (_vmbusTransLock == nullptr || _vmbusRequestsOverflowLock == nullptr || _txLock == nullptr || _rxLock == nullptr) {
+      HVSYSLOG("Failed to allocate ring buffer locks");
+      break;
+    }
+
+    //
+    // Allocate per-CPU statistics.
+    //
+    _cpuStatisticsCount = real_ncpus;
+    _cpuStatistics      = (HyperVVMBusDeviceCPUStatistics*) IOMallocAligned(sizeof (*_cpuStatistics) * _cpuStatisticsCount,
+                                                                             sizeof (*_cpuStatistics));
+    if (_cpuStatistics == nullptr) {
+      HVSYSLOG("Failed to allocate channel statistics");
+      break;
+    }
+    bzero(_cpuStatistics, sizeof (*_cpuStatistics) * _cpuStatisticsCount);
     
     _threadZeroRequest.lock = IOLockAlloc();
     prepareSleepThread();
@@ -117,17 +143,53 @@ void HyperVVMBusDevice::detach(IOService *provider) {
     OSSafeReleaseNULL(_vmbusProvider);
   }
 
-  IOLockFree(_vmbusRequestsLock);
-  IOLockFree(_vmbusTransLock);
-  IOLockFree(_threadZeroRequest.lock);
+  super::detach(provider);
+}
+
+void HyperVVMBusDevice::free() {
+  //
+  // Locks and the work loop are kept until the nub is freed, as a primary channel
+  // may still reference a sub-channel nub after it has been rescinded and detached.
+  //
+  if (_vmbusTransLock != nullptr) {
+    IOLockFree(_vmbusTransLock);
+    _vmbusTransLock = nullptr;
+  }
+  if (_vmbusRequestsOverflowLock != nullptr) {
+    IOSimpleLockFree(_vmbusRequestsOverflowLock);
+    _vmbusRequestsOverflowLock = nullptr;
+  }
+  if (_txLock != nullptr) {
+    IOSimpleLockFree(_txLock);
+    _txLock = nullptr;
+  }
+  if (_rxLock != nullptr) {
+    IOLockFree(_rxLock);
+    _rxLock = nullptr;
+  }
+  if (_threadZeroRequest.lock != nullptr) {
+    IOLockFree(_threadZeroRequest.lock);
+    _threadZeroRequest.lock = nullptr;
+  }
+  freeRequestPool();
+
+  if (_cpuStatistics != nullptr) {
+    IOFreeAligned(_cpuStatistics, sizeof (*_cpuStatistics) * _cpuStatisticsCount);
+    _cpuStatistics = nullptr;
+  }
 
   if (_commandGate != nullptr) {
     _workLoop->removeEventSource(_commandGate);
     OSSafeReleaseNULL(_commandGate);
   }
   OSSafeReleaseNULL(_workLoop);
+  if (_workLoopLock != nullptr) {
+    IOLockFree(_workLoopLock);
+    _workLoopLock = nullptr;
+  }
+  OSSafeReleaseNULL(_primaryChannel);
 
-  super::detach(provider);
+  super::free();
 }
 
 bool HyperVVMBusDevice::matchPropertyTable(OSDictionary *table, SInt32 *score) {
@@ -154,9 +216,224 @@ bool HyperVVMBusDevice::matchPropertyTable(OSDictionary *table, SInt32 *score) {
 }
 
 IOWorkLoop* HyperVVMBusDevice::getWorkLoop() const {
+  //
+  // Devices that never open their channel do not need a work loop.
+  //
+  if (_workLoop == nullptr) {
+    const_cast<HyperVVMBusDevice*>(this)->createWorkLoop();
+  }
   return _workLoop;
 }
 
+bool HyperVVMBusDevice::createWorkLoop() {
+  IOWorkLoop    *workLoop;
+  IOCommandGate *commandGate;
+
+  if (_workLoopLock == nullptr) {
+    return false;
+  }
+
+  IOLockLock(_workLoopLock);
+  if (_workLoop != nullptr) {
+    IOLockUnlock(_workLoopLock);
+    return true;
+  }
+
+  //
+  // Initialize work loop and command gate.
+  // Low-rate devices may share a work loop with other devices, selected by the nub or client driver property.
+  // Packet handlers on a shared work loop must never block, as this stalls every other device on the work loop.
+  //
+  workLoop = nullptr;
+  if (_primaryChannel != nullptr) {
+    //
+    // Sub-channels use the work loop of the primary channel.
+    //
+    workLoop = _primaryChannel->getWorkLoop();
+    if (workLoop != nullptr) {
+      workLoop->retain();
+    }
+  } else if (useSharedWorkLoop()) {
+    workLoop = _vmbusProvider->copySharedWorkLoop(_channelId);
+  }
+  if (workLoop == nullptr) {
+    workLoop = IOWorkLoop::workLoop();
+  }
+  if (workLoop == nullptr) {
+    HVSYSLOG("Failed to initialize work loop");
+    IOLockUnlock(_workLoopLock);
+    return false;
+  }
+  
+  commandGate = IOCommandGate::commandGate(this);
+  if (commandGate == nullptr) {
+    HVSYSLOG("Failed to initialize command gate");
+    workLoop->release();
+    IOLockUnlock(_workLoopLock);
+    return false;
+  }
+  workLoop->addEventSource(commandGate);
+
+  //
+  // Command gate is published first, work loop pointer signals both are ready.
+  //
+  _commandGate = commandGate;
+  OSSynchronizeIO();
+  _workLoop    = workLoop;
+  IOLockUnlock(_workLoopLock);
+
+  HVDBGLOG("Created work loop for channel %u", _channelId);
+  return true;
+}
+
+bool HyperVVMBusDevice::useSharedWorkLoop() const {
+  IOService *client;
+  OSBoolean *shared;
+
+  //
+  // Property may be set on the nub, or come from the client driver personality.
+  //
+  shared = OSDynamicCast(OSBoolean, getProperty(kHyperVVMBusDeviceSharedWorkLoopKey));
+  if (shared == nullptr) {
+    client = getClient();
+    if (client != nullptr) {
+      shared = OSDynamicCast(OSBoolean, client->getProperty(kHyperVVMBusDeviceSharedWorkLoopKey));
+    }
+  }
+  return (shared != nullptr) && shared->isTrue();
+}
+
+void HyperVVMBusDevice::releaseWorkLoop() {
+  IOWorkLoop    *workLoop;
+  IOCommandGate *commandGate;
+
+  if (_workLoopLock == nullptr) {
+    return;
+  }
+
+  IOLockLock(_workLoopLock);
+  if (_workLoop == nullptr || _channelIsOpen || _interruptSource != nullptr) {
+    IOLockUnlock(_workLoopLock);
+    return;
+  }
+  workLoop     = _workLoop;
+  commandGate  = _commandGate;
+  _workLoop    = nullptr;
+  _commandGate = nullptr;
+  IOLockUnlock(_workLoopLock);
+
+  workLoop->removeEventSource(commandGate);
+  commandGate->release();
+  workLoop->release();
+  HVDBGLOG("Released work loop for channel %u", _channelId);
+}
+
+static void setStatisticsNumber(OSDictionary *dict, const char *key, UInt64 value) {
+  OSNumber *number = OSNumber::withNumber(value, 64);
+  if (number != nullptr) {
+    dict->setObject(key, number);
+    number->release();
+  }
+}
+
+void HyperVVMBusDevice::setTimelinePhase(OSDictionary *dict, HyperVTimelinePhase phase) const {
+  HyperVController  *hvController = _vmbusProvider->getHvController();
+  OSDictionary      *phaseDict;
+  UInt64            base = 0;
+  UInt64            begin;
+  UInt64            end;
+  UInt64            unused;
+
+  //
+  // Phase start is relative to the controller starting, both are in microseconds.
+  //
+  if (!hvController->getTimelinePhase(_channelId, phase, &begin, &end)) {
+    return;
+  }
+  hvController->getTimelinePhase(0, kHyperVTimelinePhaseControllerStart, &base, &unused);
+
+  phaseDict = OSDictionary::withCapacity(2);
+  if (phaseDict != nullptr) {
+    setStatisticsNumber(phaseDict, "StartMicroseconds", (begin >= base) ? (begin - base) / 10 : 0);
+    setStatisticsNumber(phaseDict, "DurationMicroseconds", (end - begin) / 10);
+    dict->setObject(HyperVTimelinePhaseName(phase), phaseDict);
+    phaseDict->release();
+  }
+}
+
+bool HyperVVMBusDevice::serializeProperties(OSSerialize *serialize) const {
+  HyperVVMBusDeviceStatistics statistics;
+  OSDictionary                *statisticsDict;
+  OSDictionary                *timelineDict;
+
+  //
+  // Statistics are only gathered when the I/O Registry is read, they are not updated in the property table otherwise.
+  //
+  if (_cpuStatistics != nullptr) {
+    statisticsDict = OSDictionary::withCapacity(15);
+    if (statisticsDict != nullptr) {
+      getStatistics(&statistics);
+      setStatisticsNumber(statisticsDict, "Interrupts", statistics.interrupts);
+      setStatisticsNumber(statisticsDict, "FilteredInterrupts", statistics.filteredInterrupts);
+      setStatisticsNumber(statisticsDict, "DrainLoops", statistics.drainLoops);
+      setStatisticsNumber(statisticsDict, "RXPackets", statistics.rxPackets);
+      setStatisticsNumber(statisticsDict, "RXBytes", statistics.rxBytes);
+      setStatisticsNumber(statisticsDict, "TXPackets", statistics.txPackets);
+      setStatisticsNumber(statisticsDict, "TXBytes", statistics.txBytes);
+      setStatisticsNumber(statisticsDict, "HostSignals", statistics.hostSignals);
+      setStatisticsNumber(statisticsDict, "TXRingFull", statistics.txRingFull);
+      setStatisticsNumber(statisticsDict, "RXRingFull", statistics.rxRingFull);
+      setStatisticsNumber(statisticsDict, "TXRingHighWater", statistics.txRingHighWater);
+      setStatisticsNumber(statisticsDict, "RXRingHighWater", statistics.rxRingHighWater);
+      setStatisticsNumber(statisticsDict, "TXRingSize", _txRing.getSize());
+      setStatisticsNumber(statisticsDict, "RXRingSize", _rxRing.getSize());
+      if (_vmbusProvider != nullptr) {
+        setStatisticsNumber(statisticsDict, "TargetCPU", _vmbusProvider->getVMBusChannelTargetCPU(_channelId));
+      }
+
+      const_cast<HyperVVMBusDevice*>(this)->setProperty(kHyperVVMBusDeviceStatisticsKey, statisticsDict);
+      statisticsDict->release();
+    }
+  }
+
+  if (_vmbusProvider != nullptr) {
+    timelineDict = OSDictionary::withCapacity(kHyperVTimelinePhaseCount);
+    if (timelineDict != nullptr) {
+      setTimelinePhase(timelineDict, kHyperVTimelinePhaseChannelOffer);
+      setTimelinePhase(timelineDict, kHyperVTimelinePhaseChannelOpen);
+      setTimelinePhase(timelineDict, kHyperVTimelinePhaseGPADLCreate);
+      setTimelinePhase(timelineDict, kHyperVTimelinePhaseProtocolHandshake);
+      setTimelinePhase(timelineDict, kHyperVTimelinePhaseDeviceReady);
+
+      const_cast<HyperVVMBusDevice*>(this)->setProperty(kHyperVVMBusDeviceTimelineKey, timelineDict);
+      timelineDict->release();
+    }
+  }
+
+  return super::serializeProperties(serialize);
+}
+
+void HyperVVMBusDevice::getStatistics(HyperVVMBusDeviceStatistics *statistics) const {
+  const HyperVVMBusDeviceStatistics *counters;
+
+  bzero(statistics, sizeof (*statistics));
+  for (UInt32 i = 0; i < _cpuStatisticsCount; i++) {
+    counters = &_cpuStatistics[i].counters;
+    statistics->interrupts         += counters->interrupts;
+    statistics->filteredInterrupts += counters->filteredInterrupts;
+    statistics->drainLoops         += counters->drainLoops;
+    statistics->rxPackets          += counters->rxPackets;
+    statistics->rxBytes            += counters->rxBytes;
+    statistics->txPackets          += counters->txPackets;
+    statistics->txBytes            += counters->txBytes;
+    statistics->hostSignals        += counters->hostSignals;
+    statistics->txRingFull         += counters->txRingFull;
+    statistics->rxRingFull         += counters->rxRingFull;
+  }
+  statistics->txRingHighWater = _txRingHighWater;
+  statistics->rxRingHighWater = _rxRingHighWater;
+}
+
 IOReturn HyperVVMBusDevice::installPacketActions(OSObject *target, PacketReadyAction packetReadyAction, WakePacketAction wakePacketAction,
                                                  UInt32 initialResponseBufferLength, bool registerInterrupt, bool flushPackets) {
   if (target == nullptr || packetReadyAction == nullptr) {
@@ -165,6 +442,9 @@ IOReturn HyperVVMBusDevice::installPacketActions(OSObject *target, PacketReadyAc
   if (_packetActionTarget != nullptr) {
     return kIOReturnExclusiveAccess;
   }
+  if (getWorkLoop() == nullptr) {
+    return kIOReturnNoResources;
+  }
   
   _rxPacketBufferLength = initialResponseBufferLength;
   _rxPacketBuffer       = (UInt8*) IOMalloc(_rxPacketBufferLength);
@@ -174,9 +454,10 @@ IOReturn HyperVVMBusDevice::installPacketActions(OSObject *target, PacketReadyAc
   _wakePacketAction   = wakePacketAction;
   _shouldFlushPackets = flushPackets;
   if (registerInterrupt) {
-    _interruptSource = IOInterruptEventSource::interruptEventSource(this,
-                                                                    OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVVMBusDevice::handleInterrupt),
-                                                                    this, 0);
+    _interruptSource = IOFilterInterruptEventSource::filterInterruptEventSource(this,
+                                                                                OSMemberFunctionCast(IOInterruptEventAction, this, &HyperVVMBusDevice::handleInterrupt),
+                                                                                OSMemberFunctionCast(IOFilterInterruptAction, this, &HyperVVMBusDevice::filterInterrupt),
+                                                                                this, 0);
     if (_interruptSource == nullptr) {
       HVSYSLOG("Failed to configure interrupt for channel %u", _channelId);
       IOFree(_rxPacketBuffer, _rxPacketBufferLength);
@@ -200,6 +481,8 @@ void HyperVVMBusDevice::uninstallPacketActions() {
   _wakePacketAction   = nullptr;
   _packetReadyAction  = nullptr;
   _packetActionTarget = nullptr;
+  _packetFilterAction = nullptr;
+  _packetFilterTarget = nullptr;
   
   if (_rxPacketBuffer != nullptr) {
     IOFree(_rxPacketBuffer, _rxPacketBufferLength);
@@ -207,15 +490,52 @@ void HyperVVMBusDevice::uninstallPacketActions() {
   }
 }
 
+IOReturn HyperVVMBusDevice::installPacketFilterAction(OSObject *target, PacketFilterAction packetFilterAction) {
+  if (target == nullptr || packetFilterAction == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  if (_interruptSource == nullptr) {
+    return kIOReturnNotReady;
+  }
+  if (_packetFilterAction != nullptr) {
+    return kIOReturnExclusiveAccess;
+  }
+
+  //
+  // Target is set first, as the filter may run at any time.
+  //
+  _packetFilterTarget = target;
+  __sync_synchronize();
+  _packetFilterAction = packetFilterAction;
+
+  HVDBGLOG("Packet filter action installed");
+  return kIOReturnSuccess;
+}
+
 void HyperVVMBusDevice::triggerPacketAction() {
   if (_packetActionTarget == nullptr) {
     return;
   }
-  handleInterrupt(nullptr, 0);
+
+  //
+  // RX lock is not recursive, and is already held by this thread if called from a packet handler.
+  //
+  if (_rxLockThread == current_thread()) {
+    HVDBGLOG("Ignoring packet action trigger from within a packet handler");
+    return;
+  }
+
+  //
+  // Packets are processed in place within the RX ring buffer, ensure
+  // this cannot run concurrently with the interrupt handler.
+  //
+  _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::handleInterrupt));
 }
 
-IOReturn HyperVVMBusDevice::openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId) {
+IOReturn HyperVVMBusDevice::openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId, UInt32 requestCount) {
   IOReturn status;
+  UInt8    *txMirror = nullptr;
+  UInt8    *rxMirror = nullptr;
   
   if (txSize == 0 || rxSize == 0) {
     return kIOReturnBadArgument;
@@ -224,22 +544,50 @@ IOReturn HyperVVMBusDevice::openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt6
   if (_channelIsOpen) {
     return kIOReturnStillOpen;
   }
+  if (_vmbusProvider == nullptr) {
+    return kIOReturnNotAttached;
+  }
+  if (getWorkLoop() == nullptr) {
+    return kIOReturnNoResources;
+  }
   HVDBGLOG("Attempting to open channel %u (TX size: %u, RX size: %u, max trans ID: 0x%llX)", _channelId, txSize, rxSize, maxAutoTransId);
+
+  //
+  // Preallocate request contexts used for packets awaiting a response.
+  // The pool is kept across channel reopens.
+  //
+  if (_vmbusRequestPool == nullptr && requestCount != 0 && !allocateRequestPool(requestCount)) {
+    return kIOReturnNoMemory;
+  }
   
   //
   // Open channel through VMBus provider.
   // The ability to have a maximum transaction ID is supported for some devices
   // that require both rolling transaction IDs and specific transaction IDs at the same time.
   //
-  // This call is gated to prevent interrupt handler from firing partway through channel open, as some
-  // devices will start sending data immediately after opening.
+  // The open request is not gated, as it blocks until Hyper-V responds and the work loop may be shared with other devices.
   //
   _maxAutoTransId = maxAutoTransId;
-  status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::openVMBusChannelGated), &txSize, &rxSize);
+  _txBufferSize   = txSize;
+  _rxBufferSize   = rxSize;
+  recordTimeline(kHyperVTimelinePhaseChannelOpen, kHyperVTimelineEventBegin);
+  status = _vmbusProvider->openVMBusChannel(_channelId, _txBufferSize, &_txBuffer, _rxBufferSize, &_rxBuffer, &txMirror, &rxMirror);
   if (status != kIOReturnSuccess) {
     HVSYSLOG("Failed to open VMBus channel %u with status: 0x%X", _channelId, status);
+    recordTimeline(kHyperVTimelinePhaseChannelOpen, kHyperVTimelineEventFailed);
     return status;
   }
+
+  //
+  // Ring buffer state is set up gated to prevent the interrupt handler from firing partway through.
+  // Some devices will start sending data immediately after opening, the interrupt handler is triggered
+  // afterwards to pick up any packets that arrived before the channel was marked open.
+  //
+  _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::initVMBusChannelRingsGated), txMirror, rxMirror);
+  if (_interruptSource != nullptr && isRxPacketAvailable()) {
+    _interruptSource->signalInterrupt();
+  }
+  recordTimeline(kHyperVTimelinePhaseChannelOpen, kHyperVTimelineEventEnd);
   HVDBGLOG("Channel %u is now open", _channelId);
   
   return kIOReturnSuccess;
@@ -248,10 +596,24 @@ IOReturn HyperVVMBusDevice::openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt6
 IOReturn HyperVVMBusDevice::closeVMBusChannel() {
   IOReturn status;
   
+  //
+  // Sub-channels are closed before the primary channel.
+  //
+  closeSubChannels();
   if (!_channelIsOpen) {
     return kIOReturnSuccess;
   }
+
+  //
+  // Mark channel as closed with both ring buffer locks held, ensuring no
+  // readers or writers are still accessing the ring buffers.
+  //
+  IOLockLock(_rxLock);
+  IOSimpleLockLock(_txLock);
   _channelIsOpen = false;
+  IOSimpleLockUnlock(_txLock);
+  IOLockUnlock(_rxLock);
+  abortPacketRequests();
   
   //
   // Close channel.
@@ -260,8 +622,10 @@ IOReturn HyperVVMBusDevice::closeVMBusChannel() {
   HVDBGLOG("Channel %u is now closed, status 0x%X", _channelId, status);
   _txBuffer     = nullptr;
   _txBufferSize = 0;
+  _txRing.reset();
   _rxBuffer     = nullptr;
   _rxBufferSize = 0;
+  _rxRing.reset();
   
   return status;
 }
@@ -275,8 +639,14 @@ IOReturn HyperVVMBusDevice::freeGPADLBuffer(UInt32 gpadlHandle) {
 }
 
 bool HyperVVMBusDevice::nextPacketAvailable(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
-  return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::nextPacketAvailableGated),
-                                type, packetHeaderLength, packetTotalLength) == kIOReturnSuccess;
+  IOReturn status = kIOReturnNotOpen;
+
+  IOLockLock(_rxLock);
+  if (_channelIsOpen) {
+    status = nextPacketAvailableLocked(type, packetHeaderLength, packetTotalLength);
+  }
+  IOLockUnlock(_rxLock);
+  return status == kIOReturnSuccess;
 }
 
 bool HyperVVMBusDevice::nextInbandPacketAvailable(UInt32 *packetDataLength) {
@@ -288,8 +658,7 @@ bool HyperVVMBusDevice::nextInbandPacketAvailable(UInt32 *packetDataLength) {
     return false;
   }
 
-  bool result = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::nextPacketAvailableGated),
-                                       &pktType, &pktHeaderLength, &pktTotalLength) == kIOReturnSuccess;
+  bool result = nextPacketAvailable(&pktType, &pktHeaderLength, &pktTotalLength);
   
   if (result) {
     if (pktType == kVMBusPacketTypeDataInband) {
@@ -314,16 +683,25 @@ UInt64 HyperVVMBusDevice::getNextTransId() {
 }
 
 IOReturn HyperVVMBusDevice::readRawPacket(void *buffer, UInt32 bufferLength) {
-  return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::readRawPacketGated),
-                                NULL, NULL, buffer, &bufferLength);
+  IOReturn status = kIOReturnNotOpen;
+
+  IOLockLock(_rxLock);
+  if (_channelIsOpen) {
+    status = readRawPacketLocked(NULL, 0, buffer, bufferLength);
+  }
+  IOLockUnlock(_rxLock);
+  return status;
 }
 
 IOReturn HyperVVMBusDevice::readInbandCompletionPacket(void *buffer, UInt32 bufferLength, UInt64 *transactionId) {
   VMBusPacketHeader pktHeader;
-  UInt32 pktHeaderSize = sizeof (pktHeader);
+  IOReturn          status = kIOReturnNotOpen;
   
-  IOReturn status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::readRawPacketGated),
-                                           &pktHeader, &pktHeaderSize, buffer, &bufferLength);
+  IOLockLock(_rxLock);
+  if (_channelIsOpen) {
+    status = readRawPacketLocked(&pktHeader, sizeof (pktHeader), buffer, bufferLength);
+  }
+  IOLockUnlock(_rxLock);
   if (status == kIOReturnSuccess) {
     if (pktHeader.type != kVMBusPacketTypeDataInband && pktHeader.type != kVMBusPacketTypeCompletion) {
       HVMSGLOG("INBAND COMP attempted to read non-inband or non-completion packet");
@@ -338,8 +716,11 @@ IOReturn HyperVVMBusDevice::readInbandCompletionPacket(void *buffer, UInt32 buff
 }
 
 IOReturn HyperVVMBusDevice::writeRawPacket(void *buffer, UInt32 bufferLength) {
-  return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
-                                NULL, NULL, buffer, &bufferLength);
+  HyperVVMBusDeviceFragment fragment;
+
+  fragment.data   = buffer;
+  fragment.length = bufferLength;
+  return writeTxRing(&fragment, 1);
 }
 
 IOReturn HyperVVMBusDevice::writeInbandPacket(void *buffer, UInt32 bufferLength, bool responseRequired,
@@ -355,63 +736,65 @@ IOReturn HyperVVMBusDevice::writeInbandPacketWithTransactionId(void *buffer, UIn
 IOReturn HyperVVMBusDevice::writeGPADirectSinglePagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
                                                            VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
                                                            void *responseBuffer, UInt32 responseBufferLength) {
+  return writeGPADirectSinglePagePacketInternal(buffer, bufferLength, responseRequired, pageBuffers, pageBufferCount,
+                                                responseBuffer, responseBufferLength, nullptr);
+}
+
+IOReturn HyperVVMBusDevice::writeGPADirectSinglePagePacketInternal(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                                                   VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                                                   void *responseBuffer, UInt32 responseBufferLength,
+                                                                   const HyperVVMBusDeviceCompletion *completion) {
   if (pageBufferCount > kVMBusMaxPageBufferCount) {
     return kIOReturnNoResources;
   }
 
   //
-  // Create packet for single page buffers.
+  // Create packet header for single page buffers.
+  // The page buffers themselves are copied directly from the caller into the ring buffer.
   //
   UInt64 transactionId = getNextTransId();
-  VMBusPacketSinglePageBuffer pagePacket;
-  UInt32 pagePacketLength = sizeof (VMBusPacketSinglePageBuffer) -
-    ((kVMBusMaxPageBufferCount - pageBufferCount) * sizeof (VMBusSinglePageBuffer));
-
-  pagePacket.header.type          = kVMBusPacketTypeDataUsingGPADirect;
-  pagePacket.header.headerLength  = pagePacketLength >> kVMBusPacketSizeShift;
-  pagePacket.header.totalLength   = (pagePacketLength + bufferLength) >> kVMBusPacketSizeShift;
-  pagePacket.header.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
-  pagePacket.header.transactionId = transactionId;
-
-  pagePacket.reserved             = 0;
-  pagePacket.rangeCount           = pageBufferCount;
-  for (int i = 0; i < pagePacket.rangeCount; i++) {
-    pagePacket.ranges[i].length = pageBuffers[i].length;
-    pagePacket.ranges[i].offset = pageBuffers[i].offset;
-    pagePacket.ranges[i].pfn    = pageBuffers[i].pfn;
-  }
+  struct __attribute__((packed)) {
+    VMBusPacketHeader header;
+    UInt32            reserved;
+    UInt32            rangeCount;
+  } pageHeader;
+  UInt32 pagePacketLength = sizeof (pageHeader) + (pageBufferCount * sizeof (VMBusSinglePageBuffer));
+
+  pageHeader.header.type          = kVMBusPacketTypeDataUsingGPADirect;
+  pageHeader.header.headerLength  = pagePacketLength >> kVMBusPacketSizeShift;
+  pageHeader.header.totalLength   = (pagePacketLength + bufferLength) >> kVMBusPacketSizeShift;
+  pageHeader.header.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pageHeader.header.transactionId = transactionId;
+
+  pageHeader.reserved             = 0;
+  pageHeader.rangeCount           = pageBufferCount;
   
   HVMSGLOG("SP Packet type %u, flags %u, trans %llu, header length %u, total length %u, page count %u",
-           pagePacket.header.type, pagePacket.header.flags, pagePacket.header.transactionId,
-           pagePacket.header.headerLength, pagePacket.header.totalLength, pageBufferCount);
-  
-  HyperVVMBusDeviceRequest req;
-  if (responseBuffer != NULL) {
-    req.isSleeping = true;
-    req.lock = IOLockAlloc();
-    req.responseData = responseBuffer;
-    req.responseDataLength = responseBufferLength;
-    req.transactionId = transactionId;
-    addPacketRequest(&req);
-  }
-
-  IOReturn status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
-                                &pagePacket, &pagePacketLength, buffer, &bufferLength);
-  
-  if (responseBuffer != NULL) {
-    if (status == kIOReturnSuccess) {
-      sleepPacketRequest(&req);
-    } else {
-      wakeTransaction(transactionId);
-    }
-    IOLockFree(req.lock);
-  }
-  return status;
+           pageHeader.header.type, pageHeader.header.flags, pageHeader.header.transactionId,
+           pageHeader.header.headerLength, pageHeader.header.totalLength, pageBufferCount);
+
+  HyperVVMBusDeviceFragment fragments[3];
+  fragments[0].data   = &pageHeader;
+  fragments[0].length = sizeof (pageHeader);
+  fragments[1].data   = pageBuffers;
+  fragments[1].length = pageBufferCount * sizeof (VMBusSinglePageBuffer);
+  fragments[2].data   = buffer;
+  fragments[2].length = bufferLength;
+
+  return writePacketVectoredInternal(fragments, arrsize(fragments), transactionId, responseBuffer, responseBufferLength, completion);
 }
 
 IOReturn HyperVVMBusDevice::writeGPADirectMultiPagePacket(void *buffer, UInt32 bufferLength, bool responseRequired,
                                                           VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
                                                           void *responseBuffer, UInt32 responseBufferLength, UInt64 transactionId) {
+  return writeGPADirectMultiPagePacketInternal(buffer, bufferLength, responseRequired, pagePacket, pagePacketLength,
+                                               responseBuffer, responseBufferLength, transactionId, nullptr);
+}
+
+IOReturn HyperVVMBusDevice::writeGPADirectMultiPagePacketInternal(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                                                  VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
+                                                                  void *responseBuffer, UInt32 responseBufferLength, UInt64 transactionId,
+                                                                  const HyperVVMBusDeviceCompletion *completion) {
   //
   // For multi-page buffers, the packet header itself is passed to this function.
   // Ensure general header fields are set.
@@ -432,87 +815,174 @@ IOReturn HyperVVMBusDevice::writeGPADirectMultiPagePacket(void *buffer, UInt32 b
   HVMSGLOG("MP Packet type %u, flags %u, trans %llu, header length %u, total length %u",
            pagePacket->header.type, pagePacket->header.flags, pagePacket->header.transactionId,
            pagePacket->header.headerLength, pagePacket->header.totalLength);
-  
-  HyperVVMBusDeviceRequest req;
-  if (responseBuffer != NULL) {
-    req.isSleeping = true;
-    req.lock = IOLockAlloc();
-    req.responseData = responseBuffer;
-    req.responseDataLength = responseBufferLength;
-    req.transactionId = transactionId;
-    addPacketRequest(&req);
-  }
-
-  IOReturn status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
-                                pagePacket, &pagePacketLength, buffer, &bufferLength);
-  
-  if (responseBuffer != NULL) {
-    if (status == kIOReturnSuccess) {
-      sleepPacketRequest(&req);
-    } else {
-      wakeTransaction(transactionId);
-    }
-    IOLockFree(req.lock);
-  }
-  return status;
+
+  HyperVVMBusDeviceFragment fragments[2];
+  fragments[0].data   = pagePacket;
+  fragments[0].length = pagePacketLength;
+  fragments[1].data   = buffer;
+  fragments[1].length = bufferLength;
+
+  return writePacketVectoredInternal(fragments, arrsize(fragments), transactionId, responseBuffer, responseBufferLength, completion);
 }
 
 IOReturn HyperVVMBusDevice::writeCompletionPacketWithTransactionId(void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired) {
   return writePacketInternal(buffer, bufferLength, kVMBusPacketTypeCompletion, transactionId, responseRequired, NULL, 0);
 }
 
-bool HyperVVMBusDevice::getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
-  IOLockLock(_vmbusRequestsLock);
+IOReturn HyperVVMBusDevice::writeInbandPacketAsync(void *buffer, UInt32 bufferLength, OSObject *target, PacketCompletionAction completionAction,
+                                                   void *context, UInt64 transactionId) {
+  HyperVVMBusDeviceCompletion completion;
+
+  if (completionAction == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  completion.target  = target;
+  completion.action  = completionAction;
+  completion.context = context;
 
-  HyperVVMBusDeviceRequest *current = _vmbusRequests;
-  while (current != NULL) {
-    if (current->transactionId == transactionId) {
-      HVMSGLOG("Found transaction %u", transactionId);
+  if (transactionId == 0) {
+    transactionId = getNextTransId();
+  }
+  return writePacketInternal(buffer, bufferLength, kVMBusPacketTypeDataInband, transactionId, true, NULL, 0, &completion);
+}
 
-      *buffer       = current->responseData;
-      *bufferLength = current->responseDataLength;
-      IOLockUnlock(_vmbusRequestsLock);
-      return true;
-    }
-    current = current->next;
+IOReturn HyperVVMBusDevice::writeGPADirectSinglePagePacketAsync(void *buffer, UInt32 bufferLength,
+                                                                VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                                                OSObject *target, PacketCompletionAction completionAction, void *context) {
+  HyperVVMBusDeviceCompletion completion;
+
+  if (completionAction == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  completion.target  = target;
+  completion.action  = completionAction;
+  completion.context = context;
+
+  return writeGPADirectSinglePagePacketInternal(buffer, bufferLength, true, pageBuffers, pageBufferCount, NULL, 0, &completion);
+}
+
+IOReturn HyperVVMBusDevice::writeGPADirectMultiPagePacketAsync(void *buffer, UInt32 bufferLength,
+                                                               VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
+                                                               OSObject *target, PacketCompletionAction completionAction, void *context,
+                                                               UInt64 transactionId) {
+  HyperVVMBusDeviceCompletion completion;
+
+  if (completionAction == nullptr) {
+    return kIOReturnBadArgument;
+  }
+  completion.target  = target;
+  completion.action  = completionAction;
+  completion.context = context;
+
+  return writeGPADirectMultiPagePacketInternal(buffer, bufferLength, true, pagePacket, pagePacketLength, NULL, 0, transactionId, &completion);
+}
+
+IOReturn HyperVVMBusDevice::writeRawPacketVectored(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount) {
+  if (fragments == NULL || fragmentCount == 0 || fragmentCount > kHyperVVMBusDeviceMaxFragmentCount) {
+    return kIOReturnBadArgument;
+  }
+
+  return writeTxRing(fragments, fragmentCount);
+}
+
+IOReturn HyperVVMBusDevice::writeInbandPacketVectored(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, UInt64 transactionId,
+                                                      bool responseRequired, void *responseBuffer, UInt32 responseBufferLength) {
+  HyperVVMBusDeviceFragment pktFragments[kHyperVVMBusDeviceMaxFragmentCount + 1];
+  VMBusPacketHeader         pktHeader;
+  UInt32                    pktTotalLength;
+
+  //
+  // Disallow 0 for a transaction ID.
+  //
+  if (fragments == NULL || fragmentCount == 0 || fragmentCount > kHyperVVMBusDeviceMaxFragmentCount || transactionId == 0) {
+    return kIOReturnBadArgument;
   }
 
-  IOLockUnlock(_vmbusRequestsLock);
-  return false;
+  //
+  // Create inband packet header, followed by the caller's fragments.
+  // Sizes are represented as 8 byte units.
+  //
+  pktTotalLength = sizeof (pktHeader);
+  for (UInt32 i = 0; i < fragmentCount; i++) {
+    pktFragments[i + 1] = fragments[i];
+    pktTotalLength += fragments[i].length;
+  }
+
+  pktHeader.type          = kVMBusPacketTypeDataInband;
+  pktHeader.flags         = responseRequired ? kVMBusPacketResponseRequired : 0;
+  pktHeader.transactionId = transactionId;
+  pktHeader.headerLength  = sizeof (pktHeader) >> kVMBusPacketSizeShift;
+  pktHeader.totalLength   = HV_PACKETALIGN(pktTotalLength) >> kVMBusPacketSizeShift;
+
+  pktFragments[0].data   = &pktHeader;
+  pktFragments[0].length = sizeof (pktHeader);
+
+  HVMSGLOG("Vectored packet type %u, flags %u, trans %llu, fragments %u, total length %u",
+           pktHeader.type, pktHeader.flags, pktHeader.transactionId, fragmentCount, pktTotalLength);
+  return writePacketVectoredInternal(pktFragments, fragmentCount + 1, transactionId, responseBuffer, responseBufferLength);
+}
+
+IOReturn HyperVVMBusDevice::beginTxBatch(UInt32 packetCount, UInt32 totalLength) {
+  IOReturn status;
+  bool     signalHost = false;
+
+  IOSimpleLockLock(_txLock);
+  status = beginTxBatchLocked(packetCount, totalLength, &signalHost);
+  IOSimpleLockUnlock(_txLock);
+
+  if (signalHost) {
+    notifyHost();
+  }
+  return status;
+}
+
+IOReturn HyperVVMBusDevice::commitTxBatch() {
+  IOReturn status;
+  bool     signalHost = false;
+
+  IOSimpleLockLock(_txLock);
+  status = commitTxBatchLocked(&signalHost);
+  IOSimpleLockUnlock(_txLock);
+
+  if (signalHost) {
+    notifyHost();
+  }
+  return status;
+}
+
+bool HyperVVMBusDevice::getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
+  if (!getPacketRequestBuffer(transactionId, buffer, bufferLength)) {
+    return false;
+  }
+  HVMSGLOG("Found transaction %u", transactionId);
+  return true;
 }
 
 void HyperVVMBusDevice::wakeTransaction(UInt64 transactionId) {
-  IOLockLock(_vmbusRequestsLock);
-
-  HyperVVMBusDeviceRequest *current  = _vmbusRequests;
-  HyperVVMBusDeviceRequest *previous = nullptr;
-  while (current != nullptr) {
-    if (current->transactionId == transactionId) {
-      HVMSGLOG("Waking transaction %u", transactionId);
-
-      //
-      // Remove from linked list.
-      //
-      if (previous != NULL) {
-        previous->next = current->next;
-      } else {
-        _vmbusRequests = current->next;
-      }
-      IOLockUnlock(_vmbusRequestsLock);
-
-      //
-      // Wake sleeping thread.
-      //
-      IOLockLock(current->lock);
-      current->isSleeping = false;
-      IOLockUnlock(current->lock);
-      IOLockWakeup(current->lock, &current->isSleeping, true);
-      return;
-    }
-    previous  = current;
-    current   = current->next;
+  HyperVVMBusDeviceRequest *vmbusRequest;
+
+  vmbusRequest = removePacketRequest(transactionId);
+  if (vmbusRequest == nullptr) {
+    return;
+  }
+  HVMSGLOG("Waking transaction %u", transactionId);
+
+  //
+  // Asynchronous requests woken without a response are completed with an error.
+  //
+  if (vmbusRequest->completion.action != nullptr) {
+    finishPacketRequest(vmbusRequest, kIOReturnNotResponding, NULL, 0);
+    return;
   }
-  IOLockUnlock(_vmbusRequestsLock);
+
+  //
+  // Wake sleeping thread.
+  // The request may be released as soon as the lock is dropped.
+  //
+  IOLockLock(vmbusRequest->lock);
+  vmbusRequest->isSleeping = false;
+  IOLockWakeup(vmbusRequest->lock, &vmbusRequest->isSleeping, true);
+  IOLockUnlock(vmbusRequest->lock);
 }
 
 void HyperVVMBusDevice::sleepThreadZero() {
@@ -8,12 +8,14 @@
 #ifndef HyperVVMBusDevice_hpp
 #define HyperVVMBusDevice_hpp
 
+#include <IOKit/IOFilterInterruptEventSource.h>
 #include <IOKit/IOInterruptEventSource.h>
 #include <IOKit/IOTimerEventSource.h>
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
 
 #include "HyperVVMBus.hpp"
+#include "HyperVVMBusRing.hpp"
 #include "HyperV.hpp"
 #include "VMBus.hpp"
 
@@ -21,17 +23,96 @@
 #define kHyperVVMBusDeviceChannelInstanceKey    "HVInstance"
 #define kHyperVVMBusDeviceChannelIDKey          "HVChannel"
 #define kHyperVVMBusDeviceChannelMMIOByteCount  "HVMMIOByteCount"
+#define kHyperVVMBusDeviceStatisticsKey         "HVChannelStatistics"
+#define kHyperVVMBusDeviceTimelineKey           "HVChannelTimeline"
+#define kHyperVVMBusDeviceSharedWorkLoopKey     "HVSharedWorkLoop"
+#define kHyperVVMBusDeviceSubChannelIndexKey    "HVSubChannelIndex"
+
+//
+// Completion for asynchronous requests.
+// Response data is only valid for the duration of the call, and is NULL if no response data is available.
+//
+typedef void (*HyperVVMBusDeviceCompletionAction)(void *target, void *context, IOReturn status, UInt8 *pktData, UInt32 pktDataLength);
+
+typedef struct HyperVVMBusDeviceCompletion {
+  OSObject                          *target;
+  HyperVVMBusDeviceCompletionAction action;
+  void                              *context;
+} HyperVVMBusDeviceCompletion;
 
 typedef struct HyperVVMBusDeviceRequest {
-  HyperVVMBusDeviceRequest  *next;
-  IOLock                    *lock;
-  bool                      isSleeping;
+  IOLock                      *lock;
+  bool                        isSleeping;
 
-  UInt64                    transactionId;
-  void                      *responseData;
-  UInt32                    responseDataLength;
+  UInt64                      transactionId;
+  void                        *responseData;
+  UInt32                      responseDataLength;
+  HyperVVMBusDeviceCompletion completion;
+  IOReturn                    completionStatus;
+  UInt8                       *completionData;
+  UInt32                      completionDataLength;
+
+  struct HyperVVMBusDeviceRequest *next;
 } HyperVVMBusDeviceRequest;
 
+//
+// Packet fragment for vectored writes.
+// Fragments with no data are written as zeroes.
+//
+typedef HyperVVMBusRingFragment HyperVVMBusDeviceFragment;
+
+//
+// Ring buffer data area, size is determined when the channel is opened.
+//
+typedef HyperVVMBusRing<0, HyperVVMBusRingFullBarrierSync> HyperVVMBusDeviceRing;
+
+#define kHyperVVMBusDeviceMaxFragmentCount  16
+
+//
+// Channel statistics.
+// Counters are kept per CPU and summed when read. Ring high-water marks are in bytes.
+//
+typedef struct HyperVVMBusDeviceStatistics {
+  UInt64 interrupts;
+  UInt64 filteredInterrupts;
+  UInt64 drainLoops;
+  UInt64 rxPackets;
+  UInt64 rxBytes;
+  UInt64 txPackets;
+  UInt64 txBytes;
+  UInt64 hostSignals;
+  UInt64 txRingFull;
+  UInt64 rxRingFull;
+  UInt64 txRingHighWater;
+  UInt64 rxRingHighWater;
+} HyperVVMBusDeviceStatistics;
+
+//
+// Per-CPU statistics are padded to separate cache lines.
+//
+typedef struct __attribute__((aligned(64))) HyperVVMBusDeviceCPUStatistics {
+  HyperVVMBusDeviceStatistics counters;
+} HyperVVMBusDeviceCPUStatistics;
+
+//
+// Pending transaction table.
+// Requests are stored in an open-addressed table keyed by transaction ID, with probing limited to a fixed window.
+// Requests that do not fit within the window fall back to a locked overflow list.
+//
+#define kHyperVVMBusDeviceRequestTableShift     8
+#define kHyperVVMBusDeviceRequestTableSize      (1 << kHyperVVMBusDeviceRequestTableShift)
+#define kHyperVVMBusDeviceRequestTableMaxProbe  16
+
+//
+// Default number of preallocated request contexts per channel.
+//
+#define kHyperVVMBusDeviceDefaultRequestCount   16
+
+//
+// Maximum number of sub-channels that can be opened through a primary channel.
+//
+#define kHyperVVMBusDeviceMaxSubChannels        64
+
 class HyperVVMBusDevice : public IOService {
   OSDeclareDefaultStructors(HyperVVMBusDevice);
   HVDeclareLogFunctionsVMBusDeviceNub("vmbusdev");
@@ -43,6 +124,8 @@ public:
   //
   typedef void (*PacketReadyAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
   typedef bool (*WakePacketAction)(void *target, VMBusPacketHeader *pktHeader, UInt32 pktHeaderLength, UInt8 *pktData, UInt32 pktDataLength);
+  typedef bool (*PacketFilterAction)(void *target, HyperVVMBusDevice *device);
+  typedef HyperVVMBusDeviceCompletionAction PacketCompletionAction;
 
 #if DEBUG
   typedef void (*TimerDebugAction)(void *target);
@@ -61,24 +144,72 @@ private:
   //
   // Work loop and related.
   //
-  IOWorkLoop             *_workLoop           = nullptr;
-  IOCommandGate          *_commandGate        = nullptr;
-  bool                   _commandLock         = false;
-  IOInterruptEventSource *_interruptSource    = nullptr;
-  OSObject               *_packetActionTarget = nullptr;
+  IOWorkLoop                   *_workLoop           = nullptr;
+  IOCommandGate                *_commandGate        = nullptr;
+  IOLock                       *_workLoopLock       = nullptr;
+  bool                         _commandLock         = false;
+  IOFilterInterruptEventSource *_interruptSource    = nullptr;
+  OSObject                     *_packetActionTarget = nullptr;
   PacketReadyAction     _packetReadyAction    = nullptr;
   WakePacketAction      _wakePacketAction     = nullptr;
+  OSObject              *_packetFilterTarget  = nullptr;
+  PacketFilterAction    _packetFilterAction   = nullptr;
   bool                  _shouldFlushPackets   = true;
+  UInt32                _packetBudget         = 0;
+
+  //
+  // Sub-channels opened through this channel, and the primary channel if this is a sub-channel.
+  // Sub-channels are opened and closed by the client during start and stop.
+  // The primary channel is set when the sub-channel nub is attached, and is retained until the nub is freed.
+  //
+  HyperVVMBusDevice          *_primaryChannel      = nullptr;
+  HyperVVMBusDevice          *_subChannels[kHyperVVMBusDeviceMaxSubChannels] = { };
+  volatile UInt32            _subChannelsOpenCount = 0;
 
   //
   // Ring buffers for channel.
   //
   VMBusRingBuffer *_txBuffer            = nullptr;
   UInt32          _txBufferSize         = 0;
+  UInt32          _txWriteIndex         = 0;
   VMBusRingBuffer *_rxBuffer            = nullptr;
   UInt32          _rxBufferSize         = 0;
+  UInt32          _rxReadIndex          = 0;
+
+  //
+  // Ring buffer data areas.
+  // These use the ring buffer data mapped twice back-to-back if available, allowing wrapped packets to be accessed linearly.
+  //
+  HyperVVMBusDeviceRing _txRing;
+  HyperVVMBusDeviceRing _rxRing;
   UInt8           *_rxPacketBuffer      = nullptr;
   UInt32          _rxPacketBufferLength = 0;
+  UInt32          _rxInvalidPackets     = 0;
+
+  //
+  // Ring buffer locks.
+  // TX side is a spinlock held only while copying into the ring buffer, Hyper-V is signaled after it is dropped.
+  // RX side is held across each batch of packets processed by the interrupt handler.
+  // Lock ordering is RX before TX.
+  //
+  IOSimpleLock    *_txLock              = nullptr;
+  IOLock          *_rxLock              = nullptr;
+
+  //
+  // TX batching.
+  //
+  IOThread        _txBatchThread        = nullptr;
+  UInt32          _txBatchDepth         = 0;
+  UInt32          _txBatchReservedBytes = 0;
+
+  //
+  // Channel statistics.
+  // High-water marks are protected by the respective RX or TX lock.
+  //
+  HyperVVMBusDeviceCPUStatistics *_cpuStatistics     = nullptr;
+  UInt32                         _cpuStatisticsCount = 0;
+  UInt32                         _txRingHighWater    = 0;
+  UInt32                         _rxRingHighWater    = 0;
 
 #if DEBUG
   //
@@ -88,8 +219,6 @@ private:
   IOTimerEventSource  *_debugTimerSource   = nullptr;
   OSObject            *_timerDebugTarget   = nullptr;
   TimerDebugAction    _timerDebugAction    = nullptr;
-  UInt64              _numInterrupts       = 0;
-  UInt64              _numPackets          = 0;
 
   void handleDebugPrintTimer(IOTimerEventSource *sender);
 #endif
@@ -97,33 +226,99 @@ private:
   //
   // VMBus packet requests.
   //
-  HyperVVMBusDeviceRequest *_vmbusRequests     = nullptr;
-  IOLock                   *_vmbusRequestsLock = nullptr;
+  // Requests that do not fit in the table, and all one-off requests allocated outside of the pool,
+  // are kept in the overflow list. Overflow requests are only accessed with the overflow lock held.
+  //
+  HyperVVMBusDeviceRequest * volatile _vmbusRequests[kHyperVVMBusDeviceRequestTableSize] = { };
+  volatile UInt32          _vmbusRequestsCount = 0;
+  HyperVVMBusDeviceRequest *_vmbusRequestsOverflow    = nullptr;
+  IOSimpleLock             *_vmbusRequestsOverflowLock = nullptr;
   UInt64                   _vmbusTransId       = 1; // Some devices have issues with 0 as a transaction ID.
   UInt64                   _maxAutoTransId     = UINT64_MAX;
   IOLock                   *_vmbusTransLock    = nullptr;
-  HyperVVMBusDeviceRequest _threadZeroRequest = { };
+  HyperVVMBusDeviceRequest _threadZeroRequest  = { };
+  volatile UInt32          _threadZeroPending  = 0;
+
+  HyperVVMBusDeviceRequest *_vmbusRequestPool      = nullptr;
+  UInt32                   _vmbusRequestPoolCount = 0;
+  volatile UInt32          *_vmbusRequestPoolMap  = nullptr;
+
+  //
+  // Asynchronous requests completed while the RX lock is held by handleInterrupt().
+  // These are invoked once the RX lock is dropped, and are only accessed by the thread holding the RX lock.
+  // The thread is also used to detect packet handlers re-entering the RX path.
+  //
+  HyperVVMBusDeviceRequest *_rxCompletedRequests = nullptr;
+  thread_t                 _rxLockThread         = nullptr;
 
   //
   // Internal functions.
   //
   IOReturn writePacketInternal(void *buffer, UInt32 bufferLength, VMBusPacketType packetType, UInt64 transactionId,
-                               bool responseRequired, void *responseBuffer, UInt32 responseBufferLength);
+                               bool responseRequired, void *responseBuffer, UInt32 responseBufferLength,
+                               const HyperVVMBusDeviceCompletion *completion = nullptr);
+  IOReturn writePacketVectoredInternal(HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, UInt64 transactionId,
+                                       void *responseBuffer, UInt32 responseBufferLength,
+                                       const HyperVVMBusDeviceCompletion *completion = nullptr);
+  IOReturn writeGPADirectSinglePagePacketInternal(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                                  VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                                  void *responseBuffer, UInt32 responseBufferLength,
+                                                  const HyperVVMBusDeviceCompletion *completion);
+  IOReturn writeGPADirectMultiPagePacketInternal(void *buffer, UInt32 bufferLength, bool responseRequired,
+                                                 VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
+                                                 void *responseBuffer, UInt32 responseBufferLength, UInt64 transactionId,
+                                                 const HyperVVMBusDeviceCompletion *completion);
+
+  IOReturn writeTxRing(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount);
 
-  IOReturn nextPacketAvailableGated(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength);
-  IOReturn readRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength);
-  IOReturn writeRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength);
-  IOReturn writeInbandPacketGated(void *buffer, UInt32 *bufferLength, bool *responseRequired, UInt64 *transactionId);
+  //
+  // Ring buffer functions, the respective RX or TX lock must be held.
+  //
+  IOReturn nextPacketAvailableLocked(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength);
+  IOReturn readRawPacketLocked(void *header, UInt32 headerLength, void *buffer, UInt32 bufferLength);
+  IOReturn writeRawPacketLocked(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, bool *signalHost);
+  IOReturn beginTxBatchLocked(UInt32 packetCount, UInt32 totalLength, bool *signalHost);
+  IOReturn commitTxBatchLocked(bool *signalHost);
 
-  UInt32 copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength);
-  UInt32 seekPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength);
-  UInt32 copyPacketDataToRingBuffer(UInt32 writeIndex, void *data, UInt32 length);
-  UInt32 zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length);
+  IOReturn peekPacketFromRingBuffer(VMBusPacketHeader **pktHeader, UInt32 *pktTotalLength);
+  void consumePacketFromRingBuffer(UInt32 pktTotalLength);
+  void publishRxReadIndex();
+  bool publishTxWriteIndex();
+  void notifyHost();
 
+  bool allocateRequestPool(UInt32 requestCount);
+  void freeRequestPool();
+  HyperVVMBusDeviceRequest *allocatePacketRequest();
+  void releasePacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
+  bool isPooledPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
   void addPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
+  HyperVVMBusDeviceRequest *findPacketRequest(UInt64 transactionId, UInt32 *tableIndex);
+  bool getPacketRequestBuffer(UInt64 transactionId, void **buffer, UInt32 *bufferLength);
+  HyperVVMBusDeviceRequest *removePacketRequest(UInt64 transactionId, bool asyncOnly = false);
+  HyperVVMBusDeviceRequest *removeOverflowPacketRequest(UInt64 transactionId, bool asyncOnly);
+  bool removeSpecificPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
+  bool completePacketRequest(UInt64 transactionId, UInt8 *pktData, UInt32 pktDataLength);
+  void finishPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest, IOReturn status, UInt8 *pktData, UInt32 pktDataLength);
+  void invokeCompletedPacketRequests(HyperVVMBusDeviceRequest *vmbusRequests);
+  void abortPacketRequests();
   void sleepPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest);
   void prepareSleepThread();
 
+  //
+  // Statistics are updated atomically, as the thread may be preempted and moved to another CPU.
+  // Contention is still limited to threads that happened to run on the same CPU.
+  //
+  inline void addStatistic(UInt64 HyperVVMBusDeviceStatistics::*counter, UInt64 value = 1) {
+    __sync_fetch_and_add(&(_cpuStatistics[cpu_number()].counters.*counter), value);
+  }
+
+  inline UInt32 getPacketRequestTableIndex(UInt64 transactionId) {
+    //
+    // Storage uses pointers as transaction IDs, ensure low bits are mixed in.
+    //
+    return (UInt32) (((transactionId ^ (transactionId >> 32)) * 0x9E3779B97F4A7C15ULL) >> (64 - kHyperVVMBusDeviceRequestTableShift));
+  }
+
   //
   // Ring buffer.
   //
@@ -133,18 +328,18 @@ private:
   inline UInt32 getRingWriteIndex(VMBusRingBuffer *ringBuffer) {
     return ringBuffer->writeIndex;
   }
-  inline void getAvailableRingSpace(VMBusRingBuffer *ringBuffer, UInt32 ringBufferSize, UInt32 *readBytes, UInt32 *writeBytes) {
+  inline void getAvailableRingSpace(VMBusRingBuffer *ringBuffer, HyperVVMBusDeviceRing *ring, UInt32 *readBytes, UInt32 *writeBytes) {
     __sync_synchronize();
-    UInt32 writeIndex = getRingWriteIndex(ringBuffer);
-    UInt32 readIndex  = getRingReadIndex(ringBuffer);
-
-    *writeBytes = (writeIndex >= readIndex) ? (ringBufferSize - (writeIndex - readIndex)) : (readIndex - writeIndex);
-    *readBytes = ringBufferSize - *writeBytes;
+    ring->getAvailableSpace(getRingReadIndex(ringBuffer), getRingWriteIndex(ringBuffer), readBytes, writeBytes);
   }
 
 private:
+  bool filterInterrupt(IOFilterInterruptEventSource *sender);
   void handleInterrupt(IOInterruptEventSource *sender, int count);
-  IOReturn openVMBusChannelGated(UInt32 *txBufferSize, UInt32 *rxBufferSize);
+  IOReturn initVMBusChannelRingsGated(UInt8 *txMirror, UInt8 *rxMirror);
+  bool createWorkLoop();
+  bool useSharedWorkLoop() const;
+  void setTimelinePhase(OSDictionary *dict, HyperVTimelinePhase phase) const;
 
 public:
   //
@@ -152,8 +347,10 @@ public:
   //
   bool attach(IOService *provider) APPLE_KEXT_OVERRIDE;
   void detach(IOService *provider) APPLE_KEXT_OVERRIDE;
+  void free() APPLE_KEXT_OVERRIDE;
   bool matchPropertyTable(OSDictionary *table, SInt32 *score) APPLE_KEXT_OVERRIDE;
   IOWorkLoop* getWorkLoop() const APPLE_KEXT_OVERRIDE;
+  bool serializeProperties(OSSerialize *serialize) const APPLE_KEXT_OVERRIDE;
 
   //
   // Channel management.
@@ -161,14 +358,90 @@ public:
   IOReturn installPacketActions(OSObject *target, PacketReadyAction packetReadyAction, WakePacketAction wakePacketAction,
                                 UInt32 initialResponseBufferLength, bool registerInterrupt = true, bool flushPackets = true);
   void uninstallPacketActions();
+
+  //
+  // Runs the packet handlers on the calling thread for any packets in the RX ring buffer.
+  // Does nothing if called from within a packet handler, as the handlers are already running and
+  // will process any remaining packets before returning.
+  //
   void triggerPacketAction();
-  IOReturn openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId = UINT64_MAX);
+
+  //
+  // Installs a filter action invoked in primary interrupt context when the RX ring buffer has data.
+  // The filter returns true to schedule the packet handlers on the work loop, or false if it has handled the
+  // interrupt itself, such as by waking a thread that polls the channel. Interrupts with an empty
+  // RX ring buffer are always dropped before reaching the filter.
+  //
+  // The filter must not block or take any locks, and may only use the interrupt-safe functions below.
+  // Requires packet actions to be installed with a registered interrupt.
+  //
+  IOReturn installPacketFilterAction(OSObject *target, PacketFilterAction packetFilterAction);
+  IOReturn openVMBusChannel(UInt32 txSize, UInt32 rxSize, UInt64 maxAutoTransId = UINT64_MAX,
+                            UInt32 requestCount = kHyperVVMBusDeviceDefaultRequestCount);
   IOReturn closeVMBusChannel();
+
+  //
+  // Releases the work loop created on first use, if the channel is closed and no packet actions are installed.
+  // Used when a deferred channel open fails, the work loop is otherwise released when the nub is freed.
+  //
+  void releaseWorkLoop();
   IOReturn createGPADLBuffer(HyperVDMABuffer *dmaBuffer, UInt32 *gpadlHandle);
   IOReturn freeGPADLBuffer(UInt32 gpadlHandle);
   UInt32 getChannelId() { return _channelId; }
+
+  //
+  // Sets the maximum number of packets processed per interrupt (0 = unlimited).
+  // Once the budget is exhausted, the RX interrupt stays masked and processing is rescheduled
+  // on the work loop, only returning to interrupt mode once the RX ring buffer is empty.
+  // Only applies to channels using a registered interrupt with packet flushing enabled.
+  //
+  inline void setPacketBudget(UInt32 packetBudget) { _packetBudget = packetBudget; }
+
+  //
+  // Sets the CPU channel interrupts are targeted at, overriding the VMBus policy.
+  // Takes effect the next time the channel is opened, kVMBusChannelTargetCPUAny reverts to the policy.
+  //
+  inline IOReturn setTargetCPU(UInt32 cpu) { return _vmbusProvider->setVMBusChannelTargetCPU(_channelId, cpu); }
+  inline UInt32 getTargetCPU() { return _vmbusProvider->getVMBusChannelTargetCPU(_channelId); }
+
+  //
+  // Channels signal Hyper-V through the monitor page by default if one is allocated, which Hyper-V
+  // only polls periodically. Latency sensitive channels should request immediate signaling instead.
+  //
+  inline IOReturn setLowLatencySignaling(bool lowLatency) { return _vmbusProvider->setVMBusChannelLowLatency(_channelId, lowLatency); }
   uuid_t* getInstanceId() { return &_instanceId; }
 
+  //
+  // Sub-channels.
+  // Sub-channels are requested through the device protocol on the primary channel, after which Hyper-V offers them.
+  // Once offered, sub-channels are opened with their own ring buffers and target CPUs. Packet actions are not
+  // passed the receiving channel, so clients must install actions on each sub-channel from copySubChannel()
+  // with a target that sends responses on that sub-channel. Packets are then sent on the channel returned by
+  // selectChannel(). Sub-channels are closed along with the primary channel, and the client removes the
+  // sub-channel packet actions it installed afterwards.
+  //
+  inline UInt32 getSubChannelCount() { return _vmbusProvider->getVMBusSubChannelCount(_channelId); }
+  inline UInt32 getOpenSubChannelCount() { return _subChannelsOpenCount; }
+  IOReturn waitForSubChannels(UInt32 count, UInt32 timeoutMs);
+  HyperVVMBusDevice *copySubChannel(UInt32 index);
+  IOReturn openSubChannels(UInt32 txSize, UInt32 rxSize, UInt32 requestCount = kHyperVVMBusDeviceDefaultRequestCount);
+  IOReturn closeSubChannels();
+
+  //
+  // Selects the channel to send a packet on, such as by the current CPU number.
+  // Returns this channel if no sub-channels are open.
+  //
+  inline HyperVVMBusDevice *selectChannel(UInt32 hint) {
+    UInt32 index;
+    UInt32 count = _subChannelsOpenCount;
+
+    if (count == 0) {
+      return this;
+    }
+    index = hint % (count + 1);
+    return (index == 0) ? this : _subChannels[index - 1];
+  }
+
   //
   // Ring buffer.
   //
@@ -179,7 +452,7 @@ public:
     return getRingWriteIndex(_txBuffer);
   }
   inline void getAvailableTxSpace(UInt32 *readBytes, UInt32 *writeBytes) {
-    getAvailableRingSpace(_txBuffer, _txBufferSize, readBytes, writeBytes);
+    getAvailableRingSpace(_txBuffer, &_txRing, readBytes, writeBytes);
   }
   inline UInt32 getRxReadIndex() {
     return getRingReadIndex(_rxBuffer);
@@ -188,15 +461,35 @@ public:
     return getRingWriteIndex(_rxBuffer);
   }
   inline void getAvailableRxSpace(UInt32 *readBytes, UInt32 *writeBytes) {
-    getAvailableRingSpace(_rxBuffer, _rxBufferSize, readBytes, writeBytes);
+    getAvailableRingSpace(_rxBuffer, &_rxRing, readBytes, writeBytes);
+  }
+
+  //
+  // Checks if unprocessed data is in the RX ring buffer without taking any locks.
+  // Safe to call from a packet filter action.
+  //
+  inline bool isRxPacketAvailable() {
+    VMBusRingBuffer *rxBuffer = _rxBuffer;
+    if (!_channelIsOpen || rxBuffer == nullptr) {
+      return false;
+    }
+    return HyperVVMBusDeviceRing::Sync::loadIndex(&rxBuffer->writeIndex) != _rxReadIndex;
   }
 
   //
   // Misc.
   //
   inline void setDebugMessagePrinting(bool enabled) { debugPackets = enabled; }
+  void getStatistics(HyperVVMBusDeviceStatistics *statistics) const;
   inline HyperVController *getHvController() { return _vmbusProvider->getHvController(); }
 
+  //
+  // Records a boot timeline phase for this channel.
+  //
+  inline void recordTimeline(HyperVTimelinePhase phase, HyperVTimelineEvent event) {
+    _vmbusProvider->getHvController()->recordTimeline(_channelId, phase, event);
+  }
+
   //
   // Messages.
   //
@@ -220,6 +513,46 @@ public:
                                          void *responseBuffer = NULL, UInt32 responseBufferLength = 0, UInt64 transactionId = 0);
   IOReturn writeCompletionPacketWithTransactionId(void *buffer, UInt32 bufferLength, UInt64 transactionId, bool responseRequired);
 
+  //
+  // Asynchronous writes.
+  //
+  // The completion action is invoked on the work loop once the response for the packet arrives,
+  // or with kIOReturnAborted if the channel is closed first. It is not invoked if the write itself fails.
+  // If the request is instead woken with wakeTransaction(), the action is invoked with kIOReturnNotResponding.
+  // The action is never invoked with the RX lock held, and may submit further requests.
+  // The response is only matched if the client's wake packet action returns true for it.
+  //
+  IOReturn writeInbandPacketAsync(void *buffer, UInt32 bufferLength, OSObject *target, PacketCompletionAction completionAction,
+                                  void *context, UInt64 transactionId = 0);
+  IOReturn writeGPADirectSinglePagePacketAsync(void *buffer, UInt32 bufferLength,
+                                               VMBusSinglePageBuffer pageBuffers[], UInt32 pageBufferCount,
+                                               OSObject *target, PacketCompletionAction completionAction, void *context);
+  IOReturn writeGPADirectMultiPagePacketAsync(void *buffer, UInt32 bufferLength,
+                                              VMBusPacketMultiPageBuffer *pagePacket, UInt32 pagePacketLength,
+                                              OSObject *target, PacketCompletionAction completionAction, void *context,
+                                              UInt64 transactionId = 0);
+
+  //
+  // Vectored writes.
+  //
+  // Fragments are copied directly into the TX ring buffer in order, followed by any required padding.
+  // Raw packets must supply the packet header as part of the fragments.
+  //
+  IOReturn writeRawPacketVectored(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount);
+  IOReturn writeInbandPacketVectored(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, UInt64 transactionId,
+                                     bool responseRequired, void *responseBuffer = NULL, UInt32 responseBufferLength = 0);
+
+  //
+  // TX batching.
+  //
+  // Signaling Hyper-V for packets written by the calling thread between beginTxBatch() and commitTxBatch()
+  // is deferred until the batch is committed, and Hyper-V is signaled at most once. Packets in the batch may
+  // still become visible to Hyper-V before then if another thread writes a packet to the channel.
+  // Space for the packets can optionally be reserved up front, with totalLength covering the headers and data.
+  //
+  IOReturn beginTxBatch(UInt32 packetCount = 0, UInt32 totalLength = 0);
+  IOReturn commitTxBatch();
+
   bool getPendingTransaction(UInt64 transactionId, void **buffer, UInt32 *bufferLength);
   void wakeTransaction(UInt64 transactionId);
   void sleepThreadZero();
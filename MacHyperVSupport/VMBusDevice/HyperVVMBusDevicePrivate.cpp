@@ -7,23 +7,51 @@
 
 #include "HyperVVMBusDevice.hpp"
 
+#include <kern/thread.h>
+
+bool HyperVVMBusDevice::filterInterrupt(IOFilterInterruptEventSource *sender) {
+  PacketFilterAction packetFilterAction;
+
+  //
+  // Runs in primary interrupt context, no locks can be taken here.
+  //
+  // Hyper-V may interrupt with nothing new in the RX ring buffer, such as when packets were already
+  // processed by a previous pass of the handler. Avoid waking the work loop in that case.
+  //
+  if (!isRxPacketAvailable()) {
+    addStatistic(&HyperVVMBusDeviceStatistics::filteredInterrupts);
+    return false;
+  }
+
+  packetFilterAction = _packetFilterAction;
+  if (packetFilterAction != nullptr) {
+    return (*packetFilterAction)(_packetFilterTarget, this);
+  }
+  return true;
+}
+
 void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int count) {
-  IOReturn status;
+  IOReturn status = kIOReturnNotReady;
   UInt32 readBytes = 0;
   UInt32 writeBytes;
+  bool   txBatched;
+  UInt32 packetCount = 0;
+  UInt32 packetBudget = (_shouldFlushPackets && _interruptSource != nullptr) ? _packetBudget : 0;
   
   VMBusPacketHeader *pktHeader;
   UInt32            pktHeaderLength;
+  UInt32            pktTotalLength;
   UInt8             *pktData;
   UInt32            pktDataLength;
   
-  void *responseBuffer;
+  UInt64 transactionId;
+  void   *responseBuffer;
   UInt32 responseLength;
+
+  HyperVVMBusDeviceRequest *completedRequests;
   
-#if DEBUG
-  _numInterrupts++;
-#endif
-  
+  addStatistic(&HyperVVMBusDeviceStatistics::interrupts);
+
   //
   // Flush RX buffer of all packets.
   //
@@ -31,47 +59,75 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
   // any more interrupts until it is cleared.
   //
   // During each cycle, invoke previously passed in handler function from client driver.
+  // Packets are handed to the client in place within the RX ring buffer, and are only
+  // consumed once the handler has returned. The read index is published to Hyper-V once
+  // per batch of packets instead of after each packet.
+  //
+  // Any packets written by the handlers during a batch are sent to Hyper-V together.
+  //
+  // If a packet budget is configured and is exhausted, the interrupt is left masked and
+  // processing is rescheduled on the work loop. This continues until the RX buffer is empty.
+  //
+  // The RX lock is held across each batch, so handlers must not call into the RX read functions.
+  // Asynchronous request completions are deferred until the RX lock is dropped at the end of each batch.
   //
   do {
+    IOLockLock(_rxLock);
+    if (!_channelIsOpen) {
+      IOLockUnlock(_rxLock);
+      return;
+    }
+    _rxLockThread = current_thread();
+    addStatistic(&HyperVVMBusDeviceStatistics::drainLoops);
+
     if (_shouldFlushPackets) {
       _rxBuffer->interruptMask = 1;
       __sync_synchronize();
     }
     
+    txBatched = beginTxBatch() == kIOReturnSuccess;
     while (true) {
-      status = readRawPacket(_rxPacketBuffer, _rxPacketBufferLength);
-      if (status == kIOReturnNotReady) {
-        //
-        // No more packets in RX buffer.
-        //
+      if (packetBudget != 0 && packetCount >= packetBudget) {
+        status = kIOReturnBusy;
         break;
-      } else if (status == kIOReturnNoSpace) {
+      }
+
+      status = peekPacketFromRingBuffer(&pktHeader, &pktTotalLength);
+      if (status == kIOReturnIOError) {
         //
-        // Received packet is larger than current buffer, reallocate and try again.
+        // Invalid packet was dropped, continue with any remaining packets.
         //
-        IOFree(_rxPacketBuffer, _rxPacketBufferLength);
-        _rxPacketBufferLength *= 2;
-        _rxPacketBuffer = (UInt8*) IOMalloc(_rxPacketBufferLength);
-        HVDBGLOG("Incoming packet too big for buffer, reallocated to %u bytes", _rxPacketBufferLength);
         continue;
       }
+      if (status != kIOReturnSuccess) {
+        //
+        // No more packets in RX buffer, or packet could not be processed.
+        //
+        break;
+      }
       
-      pktHeader = (VMBusPacketHeader *) _rxPacketBuffer;
       pktHeaderLength = HV_GET_VMBUS_PACKETSIZE(pktHeader->headerLength);
-      pktDataLength = HV_GET_VMBUS_PACKETSIZE(pktHeader->totalLength) - pktHeaderLength;
-      pktData = &_rxPacketBuffer[pktHeaderLength];
+      pktDataLength   = pktTotalLength - pktHeaderLength;
+      pktData         = ((UInt8*) pktHeader) + pktHeaderLength;
       
-#if DEBUG
-      _numPackets++;
-#endif
+      packetCount++;
       
       //
       // If a wake packet handler was specified, determine if this is a packet type that should be checked and woken up.
       //
       if (_wakePacketAction != nullptr && (*_wakePacketAction)(_packetActionTarget, pktHeader, pktHeaderLength, pktData, pktDataLength)) {
-        if (getPendingTransaction(pktHeader->transactionId, &responseBuffer, &responseLength)) {
-          memcpy(responseBuffer, pktData, responseLength);
-          wakeTransaction(pktHeader->transactionId);
+        transactionId = pktHeader->transactionId;
+        if (completePacketRequest(transactionId, pktData, pktDataLength)) {
+          consumePacketFromRingBuffer(pktTotalLength);
+          continue;
+        }
+        if (getPendingTransaction(transactionId, &responseBuffer, &responseLength)) {
+          //
+          // Packet data is in place within the RX ring buffer, do not read past the end of the packet.
+          //
+          memcpy(responseBuffer, pktData, min(responseLength, pktDataLength));
+          consumePacketFromRingBuffer(pktTotalLength);
+          wakeTransaction(transactionId);
           continue;
         }
       }
@@ -80,6 +136,25 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
       // Invoke handler for child to process packet.
       //
       (*_packetReadyAction)(_packetActionTarget, pktHeader, pktHeaderLength, pktData, pktDataLength);
+      consumePacketFromRingBuffer(pktTotalLength);
+    }
+    publishRxReadIndex();
+    if (txBatched) {
+      commitTxBatch();
+    }
+
+    completedRequests    = _rxCompletedRequests;
+    _rxCompletedRequests = nullptr;
+    _rxLockThread        = nullptr;
+
+    if (status == kIOReturnBusy) {
+      //
+      // Budget exhausted, remain in polling mode with the interrupt masked.
+      //
+      IOLockUnlock(_rxLock);
+      invokeCompletedPacketRequests(completedRequests);
+      _interruptSource->signalInterrupt();
+      return;
     }
     
     if (_shouldFlushPackets) {
@@ -88,24 +163,29 @@ void HyperVVMBusDevice::handleInterrupt(IOInterruptEventSource *sender, int coun
     
       getAvailableRxSpace(&readBytes, &writeBytes);
     }
-  } while (_shouldFlushPackets && readBytes != 0);
+    IOLockUnlock(_rxLock);
+    invokeCompletedPacketRequests(completedRequests);
+  } while (_shouldFlushPackets && status == kIOReturnNotReady && readBytes != 0);
 }
 
-IOReturn HyperVVMBusDevice::openVMBusChannelGated(UInt32 *txSize, UInt32 *rxSize) {
-  IOReturn status;
-  
-  _txBufferSize = *txSize;
-  _rxBufferSize = *rxSize;
-  
-  status = _vmbusProvider->openVMBusChannel(_channelId, _txBufferSize, &_txBuffer, _rxBufferSize, &_rxBuffer);
-  if (status == kIOReturnSuccess) {
-    _channelIsOpen = true;
-  }
-  return status;
+IOReturn HyperVVMBusDevice::initVMBusChannelRingsGated(UInt8 *txMirror, UInt8 *rxMirror) {
+  IOLockLock(_rxLock);
+  IOSimpleLockLock(_txLock);
+  _txRing.init(_txBuffer->buffer, _txBufferSize, txMirror);
+  _rxRing.init(_rxBuffer->buffer, _rxBufferSize, rxMirror);
+  _rxReadIndex     = _rxBuffer->readIndex;
+  _txWriteIndex    = _txBuffer->writeIndex;
+  _txRingHighWater = 0;
+  _rxRingHighWater = 0;
+  _channelIsOpen   = true;
+  IOSimpleLockUnlock(_txLock);
+  IOLockUnlock(_rxLock);
+  return kIOReturnSuccess;
 }
 
 IOReturn HyperVVMBusDevice::writePacketInternal(void *buffer, UInt32 bufferLength, VMBusPacketType packetType, UInt64 transactionId,
-                                                bool responseRequired, void *responseBuffer, UInt32 responseBufferLength) {
+                                                bool responseRequired, void *responseBuffer, UInt32 responseBufferLength,
+                                                const HyperVVMBusDeviceCompletion *completion) {
   //
   // Disallow 0 for a transaction ID.
   //
@@ -135,41 +215,69 @@ IOReturn HyperVVMBusDevice::writePacketInternal(void *buffer, UInt32 bufferLengt
            pktHeader.type, pktHeader.flags, pktHeader.transactionId,
            pktHeaderLength, pktTotalLength);
   
-  HyperVVMBusDeviceRequest req;
-  if (responseBuffer != NULL) {
-    req.isSleeping = true;
-    req.lock = IOLockAlloc();
-    req.responseData = responseBuffer;
-    req.responseDataLength = responseBufferLength;
-    req.transactionId = transactionId;
-    addPacketRequest(&req);
-  }
-
-  IOReturn status = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &HyperVVMBusDevice::writeRawPacketGated),
-                                           &pktHeader, &pktHeaderLength, buffer, &bufferLength);
-  
-  if (responseBuffer != NULL) {
-    if (status == kIOReturnSuccess) {
-      sleepPacketRequest(&req);
+  HyperVVMBusDeviceFragment fragments[2];
+  fragments[0].data   = &pktHeader;
+  fragments[0].length = pktHeaderLength;
+  fragments[1].data   = buffer;
+  fragments[1].length = bufferLength;
+
+  return writePacketVectoredInternal(fragments, arrsize(fragments), transactionId, responseBuffer, responseBufferLength, completion);
+}
+
+IOReturn HyperVVMBusDevice::writePacketVectoredInternal(HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, UInt64 transactionId,
+                                                        void *responseBuffer, UInt32 responseBufferLength,
+                                                        const HyperVVMBusDeviceCompletion *completion) {
+  HyperVVMBusDeviceRequest *req = nullptr;
+  if (responseBuffer != NULL || completion != nullptr) {
+    req = allocatePacketRequest();
+    if (req == nullptr) {
+      return kIOReturnNoMemory;
+    }
+    req->isSleeping         = completion == nullptr;
+    req->responseData       = responseBuffer;
+    req->responseDataLength = responseBufferLength;
+    req->transactionId      = transactionId;
+    if (completion != nullptr) {
+      req->completion       = *completion;
     } else {
-      wakeTransaction(transactionId);
+      bzero(&req->completion, sizeof (req->completion));
+    }
+    addPacketRequest(req);
+  }
+
+  IOReturn status = writeTxRing(fragments, fragmentCount);
+
+  //
+  // Asynchronous requests are released once completed.
+  // The request may have already completed by this point.
+  // On failure, only this request is removed, other requests may share the same transaction ID.
+  // If the request was already removed by another thread, that thread is responsible for completing it.
+  //
+  if (completion != nullptr) {
+    if (status != kIOReturnSuccess && removeSpecificPacketRequest(req)) {
+      releasePacketRequest(req);
+    }
+  } else if (req != nullptr) {
+    if (status != kIOReturnSuccess && removeSpecificPacketRequest(req)) {
+      req->isSleeping = false;
     }
-    IOLockFree(req.lock);
+    sleepPacketRequest(req);
+    releasePacketRequest(req);
   }
   return status;
 }
 
-IOReturn HyperVVMBusDevice::nextPacketAvailableGated(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
+IOReturn HyperVVMBusDevice::nextPacketAvailableLocked(VMBusPacketType *type, UInt32 *packetHeaderLength, UInt32 *packetTotalLength) {
   //
   // No data to read.
   //
   __sync_synchronize();
-  if (_rxBuffer->readIndex == _rxBuffer->writeIndex) {
+  if (_rxReadIndex == _rxBuffer->writeIndex) {
     return kIOReturnNotFound;
   }
   
   VMBusPacketHeader pktHeader;
-  copyPacketDataFromRingBuffer(_rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
+  _rxRing.copyFrom(_rxReadIndex, &pktHeader, sizeof (pktHeader));
   HVMSGLOG("Packet type %u, header size %u, total size %u",
            pktHeader.type, pktHeader.headerLength << kVMBusPacketSizeShift, pktHeader.totalLength << kVMBusPacketSizeShift);
 
@@ -186,11 +294,11 @@ IOReturn HyperVVMBusDevice::nextPacketAvailableGated(VMBusPacketType *type, UInt
   return kIOReturnSuccess;
 }
 
-IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength) {
+IOReturn HyperVVMBusDevice::readRawPacketLocked(void *header, UInt32 headerLength, void *buffer, UInt32 bufferLength) {
   //
   // No data to read.
   //
-  if (_rxBuffer->readIndex == _rxBuffer->writeIndex) {
+  if (_rxReadIndex == _rxBuffer->writeIndex) {
     return kIOReturnNotReady;
   }
   
@@ -198,153 +306,765 @@ IOReturn HyperVVMBusDevice::readRawPacketGated(void *header, UInt32 *headerLengt
   // Read packet header.
   //
   VMBusPacketHeader pktHeader;
-  copyPacketDataFromRingBuffer(_rxBuffer->readIndex, sizeof (VMBusPacketHeader), &pktHeader, sizeof (VMBusPacketHeader));
+  _rxRing.copyFrom(_rxReadIndex, &pktHeader, sizeof (pktHeader));
 
   UInt32 packetTotalLength = pktHeader.totalLength << kVMBusPacketSizeShift;
   HVMSGLOG("RAW packet type %u, flags %u, trans %llu, header length %u, total length %u", pktHeader.type, pktHeader.flags,
            pktHeader.transactionId, pktHeader.headerLength << kVMBusPacketSizeShift, packetTotalLength);
-  HVMSGLOG("RAW old RX read index 0x%X, RX write index 0x%X", _rxBuffer->readIndex, _rxBuffer->writeIndex);
+  HVMSGLOG("RAW old RX read index 0x%X, RX write index 0x%X", _rxReadIndex, _rxBuffer->writeIndex);
   
-  UInt32 packetDataLength = headerLength != NULL ? packetTotalLength - *headerLength : packetTotalLength;
-  if (*bufferLength < packetDataLength) {
-    HVMSGLOG("RAW buffer too small, %u < %u", *bufferLength, packetDataLength);
+  UInt32 packetDataLength = packetTotalLength - headerLength;
+  if (bufferLength < packetDataLength) {
+    HVMSGLOG("RAW buffer too small, %u < %u", bufferLength, packetDataLength);
     return kIOReturnNoSpace;
   }
   
   //
   // Read raw packet.
   //
-  UInt32 readIndexNew = _rxBuffer->readIndex;
-  if (headerLength != NULL) {
-    readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, *headerLength, header, *headerLength);
+  UInt32 readIndexNew = _rxReadIndex;
+  if (header != NULL && headerLength != 0) {
+    readIndexNew = _rxRing.copyFrom(readIndexNew, header, headerLength);
   }
-  readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, packetDataLength, buffer, packetDataLength);
-  
-  UInt64 readIndexShifted;
-  readIndexNew = copyPacketDataFromRingBuffer(readIndexNew, sizeof (readIndexShifted), &readIndexShifted, sizeof (readIndexShifted));
-  __sync_synchronize();
+  readIndexNew = _rxRing.copyFrom(readIndexNew, buffer, packetDataLength);
+
+  //
+  // Skip trailing packet index.
+  //
+  readIndexNew = _rxRing.advanceIndex(readIndexNew, sizeof (UInt64));
   
-  _rxBuffer->readIndex = readIndexNew;
+  addStatistic(&HyperVVMBusDeviceStatistics::rxPackets);
+  addStatistic(&HyperVVMBusDeviceStatistics::rxBytes, packetTotalLength);
+  _rxReadIndex = readIndexNew;
+  publishRxReadIndex();
   HVMSGLOG("RAW new RX read index 0x%X, RX new write index 0x%X", _rxBuffer->readIndex, _rxBuffer->writeIndex);
   return kIOReturnSuccess;
 }
 
-IOReturn HyperVVMBusDevice::writeRawPacketGated(void *header, UInt32 *headerLength, void *buffer, UInt32 *bufferLength) {
-  UInt32 pktHeaderLength        = headerLength != NULL ? *headerLength : 0;
-  UInt32 pktTotalLength         = pktHeaderLength + *bufferLength;
-  UInt32 pktTotalLengthAligned  = HV_PACKETALIGN(pktTotalLength);
+IOReturn HyperVVMBusDevice::writeTxRing(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount) {
+  IOReturn status;
+  bool     signalHost = false;
+
+  //
+  // Hyper-V is signaled after the TX lock is released.
+  //
+  IOSimpleLockLock(_txLock);
+  status = writeRawPacketLocked(fragments, fragmentCount, &signalHost);
+  IOSimpleLockUnlock(_txLock);
+
+  if (signalHost) {
+    notifyHost();
+  }
+
+  //
+  // Logging is deferred until the TX lock is dropped, preemption is disabled while it is held.
+  //
+  if (status == kIOReturnNoResources) {
+    HVSYSLOG("Packet is too large for TX ring buffer on channel %u", _channelId);
+  }
+  return status;
+}
+
+IOReturn HyperVVMBusDevice::writeRawPacketLocked(const HyperVVMBusDeviceFragment *fragments, UInt32 fragmentCount, bool *signalHost) {
+  UInt32 pktTotalLength         = 0;
+  UInt32 pktTotalLengthAligned;
 
-  UInt32 writeIndexOld          = _txBuffer->writeIndex;
-  UInt32 writeIndexNew          = writeIndexOld;
-  UInt64 writeIndexShifted      = ((UInt64)writeIndexOld) << 32;
+  UInt32 writeIndexOld          = _txWriteIndex;
+  UInt32 writeIndexNew;
 
+  UInt32 readIndex;
   UInt32 readBytes;
   UInt32 writeBytes;
+  UInt32 reservedBytes          = 0;
+  UInt32 usedBytes;
+  bool   isBatchThread          = _txBatchDepth != 0 && _txBatchThread == IOThreadSelf();
+
+  if (!_channelIsOpen) {
+    return kIOReturnNotOpen;
+  }
+
+  for (UInt32 i = 0; i < fragmentCount; i++) {
+    pktTotalLength += fragments[i].length;
+  }
+  pktTotalLengthAligned = HyperVVMBusDeviceRing::alignPacketLength(pktTotalLength);
 
   //
   // Ensure there is space for the packet.
   //
   // We cannot end up with read index == write index after the write, as that would indicate an empty buffer.
+  // The check includes padding and the trailing packet index.
+  // Space reserved for an open batch can only be used by the thread that owns the batch.
   // Notify Hyper-V if the buffer is full, as we don't always notify after every write to the buffer.
   //
-  getAvailableTxSpace(&readBytes, &writeBytes);
-  if (writeBytes <= pktTotalLengthAligned) {
-    HVSYSLOG("Packet is too large for buffer (%u bytes remaining)", writeBytes);
+  readIndex = HyperVVMBusDeviceRing::Sync::loadIndex(&_txBuffer->readIndex);
+  _txRing.getAvailableSpace(readIndex, writeIndexOld, &readBytes, &writeBytes);
+  if (!isBatchThread) {
+    reservedBytes = _txBatchReservedBytes;
+  }
+  if (!_txRing.canWritePacket(readIndex, writeIndexOld, pktTotalLength, reservedBytes)) {
+    addStatistic(&HyperVVMBusDeviceStatistics::txRingFull);
+    publishTxWriteIndex();
     _txBuffer->guestToHostInterruptCount++;
-    _vmbusProvider->signalVMBusChannel(_channelId);
+    *signalHost = true;
     return kIOReturnNoResources;
   }
 
   //
   // Copy header, data, padding, and index to this packet.
   //
-  HVMSGLOG("RAW packet header length %u, total length %u, pad %u", pktHeaderLength, pktTotalLength, pktTotalLengthAligned - pktTotalLength);
-  if (header != NULL && headerLength != NULL) {
-    writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, header, *headerLength);
-  }
-  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, buffer, *bufferLength);
-  writeIndexNew = zeroPacketDataToRingBuffer(writeIndexNew, pktTotalLengthAligned - pktTotalLength);
-  writeIndexNew = copyPacketDataToRingBuffer(writeIndexNew, &writeIndexShifted, sizeof (writeIndexShifted));
+  HVMSGLOG("RAW packet fragments %u, total length %u, pad %u", fragmentCount, pktTotalLength, pktTotalLengthAligned - pktTotalLength);
+  writeIndexNew = _txRing.writePacket(writeIndexOld, fragments, fragmentCount);
   HVMSGLOG("RAW TX read index 0x%X, old TX write index 0x%X", _txBuffer->readIndex, _txBuffer->writeIndex);
   HVMSGLOG("RAW TX imask 0x%X, RX imask 0x%X, channel ID %u", _txBuffer->interruptMask, _rxBuffer->interruptMask, _channelId);
+  _txWriteIndex = writeIndexNew;
+
+  addStatistic(&HyperVVMBusDeviceStatistics::txPackets);
+  addStatistic(&HyperVVMBusDeviceStatistics::txBytes, pktTotalLengthAligned);
+  usedBytes = _txRing.getSize() - writeBytes + HyperVVMBusDeviceRing::getPacketRingLength(pktTotalLength);
+  if (_txRingHighWater < usedBytes) {
+    _txRingHighWater = usedBytes;
+  }
+
+  //
+  // Packets written as part of a batch are published when the batch is committed, or when
+  // another thread publishes its own packet.
+  //
+  if (isBatchThread) {
+    pktTotalLengthAligned += sizeof (UInt64);
+    _txBatchReservedBytes = (_txBatchReservedBytes > pktTotalLengthAligned) ? (_txBatchReservedBytes - pktTotalLengthAligned) : 0;
+  } else {
+    *signalHost = publishTxWriteIndex();
+  }
+  HVMSGLOG("RAW TX read index 0x%X, new TX write index 0x%X", _txBuffer->readIndex, _txBuffer->writeIndex);
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDevice::beginTxBatchLocked(UInt32 packetCount, UInt32 totalLength, bool *signalHost) {
+  UInt32 readIndex;
+  UInt32 readBytes;
+  UInt32 writeBytes;
+  UInt32 reservedBytes;
+
+  if (!_channelIsOpen) {
+    return kIOReturnNotOpen;
+  }
+
+  //
+  // Only a single thread may batch packets at a time, nested batches on the same thread are allowed.
+  // Other threads can continue to write packets normally.
+  //
+  if (_txBatchDepth != 0) {
+    if (_txBatchThread != IOThreadSelf()) {
+      return kIOReturnExclusiveAccess;
+    }
+    _txBatchDepth++;
+    return kIOReturnSuccess;
+  }
+
+  //
+  // Reserve space for the batch if requested.
+  // Each packet may have up to 7 bytes of padding, plus the trailing packet index.
+  //
+  reservedBytes = 0;
+  if (packetCount != 0 || totalLength != 0) {
+    reservedBytes = totalLength + (packetCount * (sizeof (UInt64) + sizeof (UInt64) - 1));
+
+    readIndex = HyperVVMBusDeviceRing::Sync::loadIndex(&_txBuffer->readIndex);
+    _txRing.getAvailableSpace(readIndex, _txWriteIndex, &readBytes, &writeBytes);
+    if (writeBytes <= reservedBytes) {
+      HVMSGLOG("Batch of %u packets is too large for buffer (%u bytes remaining)", packetCount, writeBytes);
+      addStatistic(&HyperVVMBusDeviceStatistics::txRingFull);
+      _txBuffer->guestToHostInterruptCount++;
+      *signalHost = true;
+      return kIOReturnNoResources;
+    }
+  }
+
+  _txBatchThread        = IOThreadSelf();
+  _txBatchDepth         = 1;
+  _txBatchReservedBytes = reservedBytes;
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDevice::commitTxBatchLocked(bool *signalHost) {
+  if (_txBatchDepth == 0 || _txBatchThread != IOThreadSelf()) {
+    return kIOReturnNotPermitted;
+  }
+
+  _txBatchDepth--;
+  if (_txBatchDepth == 0) {
+    _txBatchThread        = nullptr;
+    _txBatchReservedBytes = 0;
+    if (_channelIsOpen) {
+      *signalHost = publishTxWriteIndex();
+    }
+  }
+  return kIOReturnSuccess;
+}
+
+IOReturn HyperVVMBusDevice::peekPacketFromRingBuffer(VMBusPacketHeader **pktHeader, UInt32 *pktTotalLength) {
+  UInt32 readIndex = _rxReadIndex;
+  UInt32 writeIndex;
+  UInt32 readBytes;
+  UInt32 writeBytes;
+
+  //
+  // No data to read.
+  // Available data is calculated from the private read index, as previously consumed packets may not be published yet.
+  //
+  writeIndex = HyperVVMBusDeviceRing::Sync::loadIndex(&_rxBuffer->writeIndex);
+  if (readIndex == writeIndex) {
+    return kIOReturnNotReady;
+  }
+  _rxRing.getAvailableSpace(readIndex, writeIndex, &readBytes, &writeBytes);
+  if (_rxRingHighWater < readBytes) {
+    _rxRingHighWater = readBytes;
+  }
+
+  //
+  // Read packet header and validate against the data available in the ring.
+  //
+  VMBusPacketHeader header;
+  _rxRing.copyFrom(readIndex, &header, sizeof (header));
+
+  UInt32 packetHeaderLength = header.headerLength << kVMBusPacketSizeShift;
+  UInt32 packetTotalLength  = header.totalLength << kVMBusPacketSizeShift;
+  if (packetHeaderLength < sizeof (header) || packetTotalLength < packetHeaderLength
+      || packetTotalLength + sizeof (UInt64) > readBytes) {
+    //
+    // Invalid packets are dropped so they are not returned again on the next read.
+    // The packet is skipped if its total length fits within the available data, otherwise all available data is dropped.
+    // Only the first and every power of two invalid packets are logged.
+    //
+    _rxInvalidPackets++;
+    if ((_rxInvalidPackets & (_rxInvalidPackets - 1)) == 0) {
+      HVSYSLOG("Invalid packet in RX buffer (header length %u, total length %u, %u bytes available), %u dropped so far",
+               packetHeaderLength, packetTotalLength, readBytes, _rxInvalidPackets);
+    }
+    if (packetTotalLength >= sizeof (header) && packetTotalLength + sizeof (UInt64) <= readBytes) {
+      _rxReadIndex = _rxRing.skipPacket(readIndex, packetTotalLength);
+    } else {
+      _rxReadIndex = writeIndex;
+    }
+    return kIOReturnIOError;
+  }
+
+  //
+  // Packets are returned in place if the ring buffer is mirrored, or if they do not wrap around the end of the ring buffer.
+  // Wrapped packets are otherwise copied into the RX packet buffer, growing it if needed.
+  //
+  *pktHeader = (VMBusPacketHeader*) _rxRing.getLinearPointer(readIndex, packetTotalLength);
+  if (*pktHeader == nullptr) {
+    if (packetTotalLength > _rxPacketBufferLength) {
+      UInt32 newLength = _rxPacketBufferLength != 0 ? _rxPacketBufferLength : PAGE_SIZE;
+      while (newLength < packetTotalLength) {
+        newLength *= 2;
+      }
+
+      UInt8 *newBuffer = (UInt8*) IOMalloc(newLength);
+      if (newBuffer == nullptr) {
+        HVSYSLOG("Failed to allocate %u bytes for wrapped packet", newLength);
+        return kIOReturnNoMemory;
+      }
+      if (_rxPacketBuffer != nullptr) {
+        IOFree(_rxPacketBuffer, _rxPacketBufferLength);
+      }
+      _rxPacketBuffer       = newBuffer;
+      _rxPacketBufferLength = newLength;
+      HVDBGLOG("Incoming packet too big for buffer, reallocated to %u bytes", _rxPacketBufferLength);
+    }
+
+    _rxRing.copyFrom(readIndex, _rxPacketBuffer, packetTotalLength);
+    *pktHeader = (VMBusPacketHeader*) _rxPacketBuffer;
+  }
+
+  HVMSGLOG("PEEK packet type %u, flags %u, trans %llu, header length %u, total length %u", header.type, header.flags,
+           header.transactionId, packetHeaderLength, packetTotalLength);
+  addStatistic(&HyperVVMBusDeviceStatistics::rxPackets);
+  addStatistic(&HyperVVMBusDeviceStatistics::rxBytes, packetTotalLength);
+  *pktTotalLength = packetTotalLength;
+  return kIOReturnSuccess;
+}
+
+void HyperVVMBusDevice::consumePacketFromRingBuffer(UInt32 pktTotalLength) {
+  //
+  // Skip over packet and its trailing index.
+  // The space is not released back to Hyper-V until the read index is published.
+  //
+  _rxReadIndex = _rxRing.skipPacket(_rxReadIndex, pktTotalLength);
+}
+
+void HyperVVMBusDevice::publishRxReadIndex() {
+  UInt32 readIndexOld = _rxBuffer->readIndex;
+  UInt32 readBytes;
+  UInt32 writeBytes;
+  UInt32 bytesFreed;
+  UInt32 pendingSendSize;
+
+  if (readIndexOld == _rxReadIndex) {
+    return;
+  }
+
+  //
+  // Ensure all reads of consumed packets have completed before the space is released back to Hyper-V.
+  //
+  HyperVVMBusDeviceRing::Sync::storeIndex(&_rxBuffer->readIndex, _rxReadIndex);
+  HVMSGLOG("PUBLISH new RX read index 0x%X, RX write index 0x%X", _rxBuffer->readIndex, _rxBuffer->writeIndex);
+
+  //
+  // Hyper-V sets the pending send size when it is blocked on a full ring buffer.
+  // Only notify Hyper-V if the space freed by this batch crossed its threshold, it will have already
+  // been notified otherwise.
+  //
+  if (!_rxBuffer->features.pendingSendSizeSupported) {
+    return;
+  }
+  pendingSendSize = _rxBuffer->pendingSendSize;
+  if (pendingSendSize == 0) {
+    return;
+  }
+
+  //
+  // Hyper-V was blocked on a full RX ring buffer.
+  //
+  addStatistic(&HyperVVMBusDeviceStatistics::rxRingFull);
+
+  getAvailableRxSpace(&readBytes, &writeBytes);
+  bytesFreed = (_rxReadIndex >= readIndexOld) ? (_rxReadIndex - readIndexOld) : (_rxBufferSize - (readIndexOld - _rxReadIndex));
+  if (writeBytes <= pendingSendSize || writeBytes - bytesFreed > pendingSendSize) {
+    return;
+  }
+
+  HVMSGLOG("RX space %u bytes crossed pending send size %u bytes, notifying host", writeBytes, pendingSendSize);
+  _rxBuffer->guestToHostInterruptCount++;
+  notifyHost();
+}
+
+bool HyperVVMBusDevice::publishTxWriteIndex() {
+  UInt32 writeIndexOld = _txBuffer->writeIndex;
+
+  if (writeIndexOld == _txWriteIndex) {
+    return false;
+  }
 
   //
-  // Update write index and notify Hyper-V if needed.
+  // Update write index and determine if Hyper-V needs to be notified.
   // Hyper-V only needs to be notified if the ring buffer is changing state from empty to having some amount of data.
   // It does not need notification if the buffer already has some amount of data, and we are just adding more.
   //
-  _txBuffer->writeIndex = writeIndexNew;
-  __sync_synchronize();
+  HyperVVMBusDeviceRing::Sync::storeIndex(&_txBuffer->writeIndex, _txWriteIndex);
   if (_txBuffer->interruptMask == 0 && writeIndexOld == getTxReadIndex()) {
     _txBuffer->guestToHostInterruptCount++;
-    _vmbusProvider->signalVMBusChannel(_channelId);
+    return true;
   }
-  HVMSGLOG("RAW TX read index 0x%X, new TX write index 0x%X", _txBuffer->readIndex, _txBuffer->writeIndex);
-  return kIOReturnSuccess;
+  return false;
 }
 
-UInt32 HyperVVMBusDevice::copyPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength, void *data, UInt32 dataLength) {
+void HyperVVMBusDevice::notifyHost() {
+  addStatistic(&HyperVVMBusDeviceStatistics::hostSignals);
+  _vmbusProvider->signalVMBusChannel(_channelId);
+}
+
+bool HyperVVMBusDevice::allocateRequestPool(UInt32 requestCount) {
+  UInt32 mapSize = ((requestCount + 31) / 32) * sizeof (UInt32);
+
+  _vmbusRequestPool    = (HyperVVMBusDeviceRequest*) IOMalloc(sizeof (HyperVVMBusDeviceRequest) * requestCount);
+  _vmbusRequestPoolMap = (volatile UInt32*) IOMalloc(mapSize);
+  if (_vmbusRequestPool == nullptr || _vmbusRequestPoolMap == nullptr) {
+    HVSYSLOG("Failed to allocate request pool");
+    freeRequestPool();
+    return false;
+  }
+  bzero(_vmbusRequestPool, sizeof (HyperVVMBusDeviceRequest) * requestCount);
+  bzero((void*) _vmbusRequestPoolMap, mapSize);
+  _vmbusRequestPoolCount = requestCount;
+
+  for (UInt32 i = 0; i < _vmbusRequestPoolCount; i++) {
+    _vmbusRequestPool[i].lock = IOLockAlloc();
+    if (_vmbusRequestPool[i].lock == nullptr) {
+      HVSYSLOG("Failed to allocate request pool lock");
+      freeRequestPool();
+      return false;
+    }
+  }
+
+  HVDBGLOG("Allocated pool of %u requests", _vmbusRequestPoolCount);
+  return true;
+}
+
+void HyperVVMBusDevice::freeRequestPool() {
+  if (_vmbusRequestPool != nullptr) {
+    for (UInt32 i = 0; i < _vmbusRequestPoolCount; i++) {
+      if (_vmbusRequestPool[i].lock != nullptr) {
+        IOLockFree(_vmbusRequestPool[i].lock);
+      }
+    }
+    IOFree(_vmbusRequestPool, sizeof (HyperVVMBusDeviceRequest) * _vmbusRequestPoolCount);
+    _vmbusRequestPool = nullptr;
+  }
+  if (_vmbusRequestPoolMap != nullptr) {
+    IOFree((void*) _vmbusRequestPoolMap, ((_vmbusRequestPoolCount + 31) / 32) * sizeof (UInt32));
+    _vmbusRequestPoolMap = nullptr;
+  }
+  _vmbusRequestPoolCount = 0;
+}
+
+HyperVVMBusDeviceRequest* HyperVVMBusDevice::allocatePacketRequest() {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+
+  for (UInt32 i = 0; i < _vmbusRequestPoolCount; i++) {
+    if (!sync_test_and_set_bit(i, _vmbusRequestPoolMap)) {
+      return &_vmbusRequestPool[i];
+    }
+  }
+
   //
-  // Check for wraparound.
+  // Pool is exhausted, fall back to allocating a one-off request.
   //
-  if (dataLength > _rxBufferSize - readIndex) {
-    UInt32 fragmentLength = _rxBufferSize - readIndex;
-    HVMSGLOG("RX wraparound by %u bytes", fragmentLength);
-    memcpy(data, &_rxBuffer->buffer[readIndex], fragmentLength);
-    memcpy((UInt8*) data + fragmentLength, _rxBuffer->buffer, dataLength - fragmentLength);
-  } else {
-    memcpy(data, &_rxBuffer->buffer[readIndex], dataLength);
+  HVDBGLOG("Request pool exhausted, allocating request");
+  vmbusRequest = (HyperVVMBusDeviceRequest*) IOMalloc(sizeof (*vmbusRequest));
+  if (vmbusRequest == nullptr) {
+    return nullptr;
   }
-  
-  return (readIndex + readLength) % _rxBufferSize;
+  bzero(vmbusRequest, sizeof (*vmbusRequest));
+
+  vmbusRequest->lock = IOLockAlloc();
+  if (vmbusRequest->lock == nullptr) {
+    IOFree(vmbusRequest, sizeof (*vmbusRequest));
+    return nullptr;
+  }
+  return vmbusRequest;
+}
+
+void HyperVVMBusDevice::releasePacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
+  if (isPooledPacketRequest(vmbusRequest)) {
+    sync_clear_bit((long) (vmbusRequest - _vmbusRequestPool), _vmbusRequestPoolMap);
+    return;
+  }
+
+  //
+  // One-off requests are only ever kept in the overflow list, and are released only once removed from it.
+  // No other thread can still be reading the request at this point.
+  //
+  IOLockFree(vmbusRequest->lock);
+  IOFree(vmbusRequest, sizeof (*vmbusRequest));
 }
 
-UInt32 HyperVVMBusDevice::seekPacketDataFromRingBuffer(UInt32 readIndex, UInt32 readLength) {
-  return (readIndex + readLength) % _rxBufferSize;
+bool HyperVVMBusDevice::isPooledPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
+  return vmbusRequest >= _vmbusRequestPool && vmbusRequest < &_vmbusRequestPool[_vmbusRequestPoolCount];
 }
 
-UInt32 HyperVVMBusDevice::copyPacketDataToRingBuffer(UInt32 writeIndex, void *data, UInt32 length) {
+void HyperVVMBusDevice::addPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
+  UInt32 tableIndex = getPacketRequestTableIndex(vmbusRequest->transactionId);
+
   //
-  // Check for wraparound.
+  // Count is incremented first so lookups cannot miss a request being added.
   //
-  if (length > _txBufferSize - writeIndex) {
-    UInt32 fragmentLength = _txBufferSize - writeIndex;
-    HVMSGLOG("TX wraparound by %u bytes", fragmentLength);
-    memcpy(&_txBuffer->buffer[writeIndex], data, fragmentLength);
-    memcpy(_txBuffer->buffer, (UInt8*) data + fragmentLength, length - fragmentLength);
-  } else {
-    memcpy(&_txBuffer->buffer[writeIndex], data, length);
+  __sync_fetch_and_add(&_vmbusRequestsCount, 1);
+
+  //
+  // Pool requests are never freed while the nub exists, and can be safely read from the table without a lock.
+  // One-off requests may be freed once removed, and always go into the overflow list.
+  //
+  if (isPooledPacketRequest(vmbusRequest)) {
+    for (UInt32 i = 0; i < kHyperVVMBusDeviceRequestTableMaxProbe; i++) {
+      UInt32 index = (tableIndex + i) & (kHyperVVMBusDeviceRequestTableSize - 1);
+      if (_vmbusRequests[index] == nullptr && __sync_bool_compare_and_swap(&_vmbusRequests[index], nullptr, vmbusRequest)) {
+        return;
+      }
+    }
+    HVDBGLOG("No free request slots for transaction %llu, using overflow list", vmbusRequest->transactionId);
   }
-  
-  return (writeIndex + length) % _txBufferSize;
+
+  IOSimpleLockLock(_vmbusRequestsOverflowLock);
+  vmbusRequest->next     = _vmbusRequestsOverflow;
+  _vmbusRequestsOverflow = vmbusRequest;
+  IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
 }
 
-UInt32 HyperVVMBusDevice::zeroPacketDataToRingBuffer(UInt32 writeIndex, UInt32 length) {
+HyperVVMBusDeviceRequest* HyperVVMBusDevice::findPacketRequest(UInt64 transactionId, UInt32 *tableIndex) {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+  UInt32                   startIndex;
+
   //
-  // Check for wraparound.
+  // Thread zero request is kept outside of the table, as it is almost always pending.
   //
-  if (length > _txBufferSize - writeIndex) {
-    UInt32 fragmentLength = _txBufferSize - writeIndex;
-    HVMSGLOG("TX wraparound by %u bytes", fragmentLength);
-    memset(&_txBuffer->buffer[writeIndex], 0, fragmentLength);
-    memset(_txBuffer->buffer, 0, length - fragmentLength);
-  } else {
-    memset(&_txBuffer->buffer[writeIndex], 0, length);
+  if (transactionId == 0) {
+    if (_threadZeroPending == 0) {
+      return nullptr;
+    }
+    *tableIndex = kHyperVVMBusDeviceRequestTableSize;
+    return &_threadZeroRequest;
   }
-  
-  return (writeIndex + length) % _txBufferSize;
+
+  //
+  // Most completions do not have a waiting request.
+  // Only the table is searched here, overflow requests must be looked up with the overflow lock held.
+  //
+  if (_vmbusRequestsCount == 0) {
+    return nullptr;
+  }
+
+  startIndex = getPacketRequestTableIndex(transactionId);
+  for (UInt32 i = 0; i < kHyperVVMBusDeviceRequestTableMaxProbe; i++) {
+    UInt32 index = (startIndex + i) & (kHyperVVMBusDeviceRequestTableSize - 1);
+    vmbusRequest = _vmbusRequests[index];
+    if (vmbusRequest != nullptr && vmbusRequest->transactionId == transactionId) {
+      *tableIndex = index;
+      return vmbusRequest;
+    }
+  }
+  return nullptr;
 }
 
-void HyperVVMBusDevice::addPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
-  IOLockLock(_vmbusRequestsLock);
-  if (_vmbusRequests == nullptr) {
-    _vmbusRequests       = vmbusRequest;
-    _vmbusRequests->next = nullptr;
+bool HyperVVMBusDevice::getPacketRequestBuffer(UInt64 transactionId, void **buffer, UInt32 *bufferLength) {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+  UInt32                   tableIndex;
+  bool                     found = false;
+
+  //
+  // Asynchronous requests do not have a response buffer.
+  // Synchronous requests are not released until woken, so the buffer remains valid for the caller.
+  //
+  vmbusRequest = findPacketRequest(transactionId, &tableIndex);
+  if (vmbusRequest != nullptr) {
+    if (vmbusRequest->completion.action != nullptr) {
+      return false;
+    }
+    *buffer       = vmbusRequest->responseData;
+    *bufferLength = vmbusRequest->responseDataLength;
+    return true;
+  }
+
+  if (transactionId == 0 || _vmbusRequestsOverflow == nullptr) {
+    return false;
+  }
+  IOSimpleLockLock(_vmbusRequestsOverflowLock);
+  for (vmbusRequest = _vmbusRequestsOverflow; vmbusRequest != nullptr; vmbusRequest = vmbusRequest->next) {
+    if (vmbusRequest->transactionId == transactionId && vmbusRequest->completion.action == nullptr) {
+      *buffer       = vmbusRequest->responseData;
+      *bufferLength = vmbusRequest->responseDataLength;
+      found         = true;
+      break;
+    }
+  }
+  IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+  return found;
+}
+
+HyperVVMBusDeviceRequest* HyperVVMBusDevice::removePacketRequest(UInt64 transactionId, bool asyncOnly) {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+  UInt32                   tableIndex;
+
+  //
+  // Remove from table, only one caller can succeed in removing a request.
+  //
+  vmbusRequest = findPacketRequest(transactionId, &tableIndex);
+  if (vmbusRequest == nullptr) {
+    return transactionId != 0 ? removeOverflowPacketRequest(transactionId, asyncOnly) : nullptr;
+  }
+  if (asyncOnly && vmbusRequest->completion.action == nullptr) {
+    return nullptr;
+  }
+  if (vmbusRequest == &_threadZeroRequest) {
+    if (!__sync_bool_compare_and_swap(&_threadZeroPending, 1, 0)) {
+      return nullptr;
+    }
   } else {
-    vmbusRequest->next = _vmbusRequests;
-    _vmbusRequests     = vmbusRequest;
+    if (!__sync_bool_compare_and_swap(&_vmbusRequests[tableIndex], vmbusRequest, nullptr)) {
+      return nullptr;
+    }
+    __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+  }
+  return vmbusRequest;
+}
+
+HyperVVMBusDeviceRequest* HyperVVMBusDevice::removeOverflowPacketRequest(UInt64 transactionId, bool asyncOnly) {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+  HyperVVMBusDeviceRequest **prevNext;
+
+  if (_vmbusRequestsOverflow == nullptr) {
+    return nullptr;
+  }
+
+  IOSimpleLockLock(_vmbusRequestsOverflowLock);
+  for (prevNext = &_vmbusRequestsOverflow; *prevNext != nullptr; prevNext = &(*prevNext)->next) {
+    vmbusRequest = *prevNext;
+    if (vmbusRequest->transactionId == transactionId && (!asyncOnly || vmbusRequest->completion.action != nullptr)) {
+      *prevNext          = vmbusRequest->next;
+      vmbusRequest->next = nullptr;
+      __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+      IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+      return vmbusRequest;
+    }
+  }
+  IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+  return nullptr;
+}
+
+bool HyperVVMBusDevice::removeSpecificPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
+  HyperVVMBusDeviceRequest **prevNext;
+  UInt32                   startIndex;
+
+  //
+  // Match on the request itself rather than the transaction ID, which may be in use by more than one request.
+  //
+  if (isPooledPacketRequest(vmbusRequest)) {
+    startIndex = getPacketRequestTableIndex(vmbusRequest->transactionId);
+    for (UInt32 i = 0; i < kHyperVVMBusDeviceRequestTableMaxProbe; i++) {
+      UInt32 index = (startIndex + i) & (kHyperVVMBusDeviceRequestTableSize - 1);
+      if (_vmbusRequests[index] == vmbusRequest) {
+        if (!__sync_bool_compare_and_swap(&_vmbusRequests[index], vmbusRequest, nullptr)) {
+          return false;
+        }
+        __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+        return true;
+      }
+    }
+  }
+
+  IOSimpleLockLock(_vmbusRequestsOverflowLock);
+  for (prevNext = &_vmbusRequestsOverflow; *prevNext != nullptr; prevNext = &(*prevNext)->next) {
+    if (*prevNext == vmbusRequest) {
+      *prevNext          = vmbusRequest->next;
+      vmbusRequest->next = nullptr;
+      __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+      IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+      return true;
+    }
+  }
+  IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+  return false;
+}
+
+bool HyperVVMBusDevice::completePacketRequest(UInt64 transactionId, UInt8 *pktData, UInt32 pktDataLength) {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+
+  //
+  // Only asynchronous requests are completed here.
+  // The request is only read once it has been removed and is owned by this thread.
+  //
+  vmbusRequest = removePacketRequest(transactionId, true);
+  if (vmbusRequest == nullptr) {
+    return false;
+  }
+
+  HVMSGLOG("Completing transaction %llu", transactionId);
+  finishPacketRequest(vmbusRequest, kIOReturnSuccess, pktData, pktDataLength);
+  return true;
+}
+
+void HyperVVMBusDevice::finishPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest, IOReturn status, UInt8 *pktData, UInt32 pktDataLength) {
+  HyperVVMBusDeviceCompletion completion;
+
+  //
+  // Request must have been removed and be owned by the calling thread.
+  // Completions are invoked immediately unless the RX lock is held by handleInterrupt() on this thread.
+  //
+  if (_rxLockThread != current_thread()) {
+    completion = vmbusRequest->completion;
+    releasePacketRequest(vmbusRequest);
+    (*completion.action)(completion.target, completion.context, status, pktData, pktDataLength);
+    return;
+  }
+
+  //
+  // Packet data is within the RX ring buffer and will be consumed before the completion is invoked, copy it.
+  //
+  vmbusRequest->completionStatus     = status;
+  vmbusRequest->completionData       = NULL;
+  vmbusRequest->completionDataLength = 0;
+  if (pktData != NULL && pktDataLength != 0) {
+    vmbusRequest->completionData = (UInt8*) IOMalloc(pktDataLength);
+    if (vmbusRequest->completionData != NULL) {
+      memcpy(vmbusRequest->completionData, pktData, pktDataLength);
+      vmbusRequest->completionDataLength = pktDataLength;
+    } else {
+      HVSYSLOG("Failed to allocate response data for transaction %llu", vmbusRequest->transactionId);
+      vmbusRequest->completionStatus = kIOReturnNoMemory;
+    }
+  }
+
+  vmbusRequest->next   = _rxCompletedRequests;
+  _rxCompletedRequests = vmbusRequest;
+}
+
+void HyperVVMBusDevice::invokeCompletedPacketRequests(HyperVVMBusDeviceRequest *vmbusRequests) {
+  HyperVVMBusDeviceRequest    *vmbusRequest;
+  HyperVVMBusDeviceRequest    *nextRequest;
+  HyperVVMBusDeviceRequest    *orderedRequests = nullptr;
+  HyperVVMBusDeviceCompletion completion;
+  IOReturn                    status;
+  UInt8                       *data;
+  UInt32                      dataLength;
+
+  //
+  // Requests were queued in reverse order, invoke completions in the order the responses arrived.
+  //
+  for (vmbusRequest = vmbusRequests; vmbusRequest != nullptr; vmbusRequest = nextRequest) {
+    nextRequest        = vmbusRequest->next;
+    vmbusRequest->next = orderedRequests;
+    orderedRequests    = vmbusRequest;
+  }
+
+  for (vmbusRequest = orderedRequests; vmbusRequest != nullptr; vmbusRequest = nextRequest) {
+    nextRequest = vmbusRequest->next;
+    completion  = vmbusRequest->completion;
+    status      = vmbusRequest->completionStatus;
+    data        = vmbusRequest->completionData;
+    dataLength  = vmbusRequest->completionDataLength;
+    releasePacketRequest(vmbusRequest);
+
+    (*completion.action)(completion.target, completion.context, status, data, dataLength);
+    if (data != NULL) {
+      IOFree(data, dataLength);
+    }
+  }
+}
+
+void HyperVVMBusDevice::abortPacketRequests() {
+  HyperVVMBusDeviceRequest *vmbusRequest;
+
+  //
+  // Abort any outstanding asynchronous requests.
+  //
+  for (UInt32 i = 0; i < kHyperVVMBusDeviceRequestTableSize && _vmbusRequestsCount != 0; i++) {
+    vmbusRequest = _vmbusRequests[i];
+    if (vmbusRequest == nullptr || vmbusRequest->completion.action == nullptr) {
+      continue;
+    }
+    if (!__sync_bool_compare_and_swap(&_vmbusRequests[i], vmbusRequest, nullptr)) {
+      continue;
+    }
+    __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+
+    HVDBGLOG("Aborting transaction %llu", vmbusRequest->transactionId);
+    finishPacketRequest(vmbusRequest, kIOReturnAborted, NULL, 0);
+  }
+
+  //
+  // Overflow requests are removed one at a time, as the lock cannot be held across the completion.
+  //
+  while (_vmbusRequestsOverflow != nullptr) {
+    vmbusRequest = nullptr;
+    IOSimpleLockLock(_vmbusRequestsOverflowLock);
+    for (HyperVVMBusDeviceRequest **prevNext = &_vmbusRequestsOverflow; *prevNext != nullptr; prevNext = &(*prevNext)->next) {
+      if ((*prevNext)->completion.action != nullptr) {
+        vmbusRequest       = *prevNext;
+        *prevNext          = vmbusRequest->next;
+        vmbusRequest->next = nullptr;
+        __sync_fetch_and_sub(&_vmbusRequestsCount, 1);
+        break;
+      }
+    }
+    IOSimpleLockUnlock(_vmbusRequestsOverflowLock);
+    if (vmbusRequest == nullptr) {
+      break;
+    }
+
+    HVDBGLOG("Aborting transaction %llu", vmbusRequest->transactionId);
+    finishPacketRequest(vmbusRequest, kIOReturnAborted, NULL, 0);
   }
-  IOLockUnlock(_vmbusRequestsLock);
 }
 
 void HyperVVMBusDevice::sleepPacketRequest(HyperVVMBusDeviceRequest *vmbusRequest) {
@@ -364,15 +1084,19 @@ void HyperVVMBusDevice::prepareSleepThread() {
   //
   _threadZeroRequest.isSleeping    = true;
   _threadZeroRequest.transactionId = 0;
-  addPacketRequest(&_threadZeroRequest);
+  __sync_synchronize();
+  _threadZeroPending = 1;
 }
 
 #if DEBUG
 void HyperVVMBusDevice::handleDebugPrintTimer(IOTimerEventSource *sender) {
+  HyperVVMBusDeviceStatistics statistics;
+
   if (_channelIsOpen) {
+    getStatistics(&statistics);
     HVSYSLOG("TXR 0x%X TXW 0x%X RXR 0x%X RXW 0x%X interrupts %llu (TX imask: %u) packets %llu",
              getTxReadIndex(), getTxWriteIndex(), getRxReadIndex(), getRxWriteIndex(),
-             _numInterrupts, _txBuffer->interruptMask, _numPackets);
+             statistics.interrupts, _txBuffer->interruptMask, statistics.rxPackets);
     
     if (_timerDebugAction != nullptr) {
       (*_timerDebugAction)(_timerDebugTarget);
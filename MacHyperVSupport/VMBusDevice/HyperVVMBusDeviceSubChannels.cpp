@@ -0,0 +1,126 @@
+//
+//  HyperVVMBusDeviceSubChannels.cpp
+//  Hyper-V VMBus device nub sub-channel support
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#include "HyperVVMBusDevice.hpp"
+
+IOReturn HyperVVMBusDevice::waitForSubChannels(UInt32 count, UInt32 timeoutMs) {
+  IOReturn status;
+
+  if (_primaryChannel != nullptr || count > kHyperVVMBusDeviceMaxSubChannels) {
+    return kIOReturnBadArgument;
+  }
+
+  HVDBGLOG("Waiting for %u sub-channels on channel %u", count, _channelId);
+  status = _vmbusProvider->waitForVMBusSubChannels(_channelId, count, timeoutMs);
+  if (status != kIOReturnSuccess) {
+    HVSYSLOG("Timed out waiting for %u sub-channels on channel %u (%u offered)", count, _channelId, getSubChannelCount());
+  }
+  return status;
+}
+
+HyperVVMBusDevice *HyperVVMBusDevice::copySubChannel(UInt32 index) {
+  HyperVVMBusDevice *subChannel;
+
+  if (_primaryChannel != nullptr || _vmbusProvider == nullptr) {
+    return nullptr;
+  }
+
+  subChannel = _vmbusProvider->copyVMBusSubChannel(_channelId, index);
+  if (subChannel != nullptr && subChannel->_primaryChannel != this) {
+    subChannel->release();
+    return nullptr;
+  }
+  return subChannel;
+}
+
+IOReturn HyperVVMBusDevice::openSubChannels(UInt32 txSize, UInt32 rxSize, UInt32 requestCount) {
+  HyperVVMBusDevice *subChannel;
+  UInt32            subChannelCount;
+  bool              lowLatency;
+  IOReturn          status = kIOReturnSuccess;
+
+  if (_primaryChannel != nullptr) {
+    return kIOReturnUnsupported;
+  }
+  if (!_channelIsOpen) {
+    return kIOReturnNotOpen;
+  }
+  if (_subChannelsOpenCount != 0) {
+    return kIOReturnStillOpen;
+  }
+
+  subChannelCount = getSubChannelCount();
+  if (subChannelCount > kHyperVVMBusDeviceMaxSubChannels) {
+    subChannelCount = kHyperVVMBusDeviceMaxSubChannels;
+  }
+  lowLatency = _vmbusProvider->_vmbusChannels[_channelId].lowLatency;
+
+  for (UInt32 i = 0; i < subChannelCount; i++) {
+    subChannel = copySubChannel(i);
+    if (subChannel == nullptr) {
+      status = kIOReturnNotFound;
+      break;
+    }
+
+    //
+    // Packet actions must be installed on each sub-channel by the client, as the primary channel actions
+    // would respond to packets on the primary channel instead of the sub-channel they arrived on.
+    //
+    if (subChannel->_packetActionTarget == nullptr) {
+      HVSYSLOG("No packet actions installed on sub-channel %u of channel %u", subChannel->_channelId, _channelId);
+      status = kIOReturnNotReady;
+    } else if (subChannel->_vmbusProvider == nullptr) {
+      //
+      // Sub-channel was rescinded after being offered.
+      //
+      status = kIOReturnNotAttached;
+    }
+    if (status == kIOReturnSuccess) {
+      subChannel->setLowLatencySignaling(lowLatency);
+      status = subChannel->openVMBusChannel(txSize, rxSize, _maxAutoTransId, requestCount);
+    }
+    if (status != kIOReturnSuccess) {
+      HVSYSLOG("Failed to open sub-channel %u of channel %u with status 0x%X", subChannel->_channelId, _channelId, status);
+      subChannel->release();
+      break;
+    }
+
+    //
+    // Sub-channel is published only once open.
+    //
+    _subChannels[i] = subChannel;
+    __sync_synchronize();
+    _subChannelsOpenCount = i + 1;
+    HVDBGLOG("Opened sub-channel %u of channel %u", subChannel->_channelId, _channelId);
+  }
+
+  if (status != kIOReturnSuccess) {
+    closeSubChannels();
+  }
+  return status;
+}
+
+IOReturn HyperVVMBusDevice::closeSubChannels() {
+  UInt32 subChannelCount = _subChannelsOpenCount;
+
+  //
+  // Stop selecting sub-channels before closing them.
+  // No packets may be in the process of being sent on sub-channels at this point.
+  //
+  _subChannelsOpenCount = 0;
+  __sync_synchronize();
+
+  for (UInt32 i = 0; i < subChannelCount; i++) {
+    _subChannels[i]->closeVMBusChannel();
+    OSSafeReleaseNULL(_subChannels[i]);
+  }
+
+  if (subChannelCount != 0) {
+    HVDBGLOG("Closed %u sub-channels of channel %u", subChannelCount, _channelId);
+  }
+  return kIOReturnSuccess;
+}
@@ -0,0 +1,240 @@
+//
+//  HyperVVMBusRing.hpp
+//  Hyper-V VMBus ring buffer core
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+
+#ifndef HyperVVMBusRing_hpp
+#define HyperVVMBusRing_hpp
+
+//
+// This header is freestanding and is shared between the kext and userspace tools.
+// It must not depend on IOKit or any other kernel-only headers.
+//
+#include <stdint.h>
+#include <string.h>
+
+//
+// Packet fragment for vectored writes.
+// Fragments with no data are written as zeroes.
+//
+typedef struct HyperVVMBusRingFragment {
+  const void                *data;
+  uint32_t                  length;
+} HyperVVMBusRingFragment;
+
+//
+// Synchronization policies for ring buffer index access.
+//
+// Full barrier policy matches what Hyper-V expects from a guest, and is used by the kext.
+//
+struct HyperVVMBusRingFullBarrierSync {
+  static inline void barrier() {
+    __sync_synchronize();
+  }
+  static inline uint32_t loadIndex(const volatile uint32_t *index) {
+    __sync_synchronize();
+    uint32_t value = *index;
+    __sync_synchronize();
+    return value;
+  }
+  static inline void storeIndex(volatile uint32_t *index, uint32_t value) {
+    __sync_synchronize();
+    *index = value;
+    __sync_synchronize();
+  }
+};
+
+//
+// Acquire/release policy, sufficient for a single producer and single consumer.
+//
+struct HyperVVMBusRingAcquireReleaseSync {
+  static inline void barrier() {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  static inline uint32_t loadIndex(const volatile uint32_t *index) {
+    return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+  }
+  static inline void storeIndex(volatile uint32_t *index, uint32_t value) {
+    __atomic_store_n(index, value, __ATOMIC_RELEASE);
+  }
+};
+
+//
+// No synchronization, for single threaded use only.
+//
+struct HyperVVMBusRingNoSync {
+  static inline void barrier() { }
+  static inline uint32_t loadIndex(const volatile uint32_t *index) {
+    return *index;
+  }
+  static inline void storeIndex(volatile uint32_t *index, uint32_t value) {
+    *index = value;
+  }
+};
+
+//
+// VMBus ring buffer data area.
+//
+// kRingSize is the size of the ring data in bytes, or 0 if the size is only known at runtime.
+// If a mirror is provided, it must map the ring data twice back-to-back, allowing all accesses to be linear.
+//
+// Each packet is padded to 8 bytes and followed by a 64-bit trailing value containing the
+// write index the packet started at in the upper 32 bits.
+//
+template <uint32_t kRingSize, class SyncPolicy>
+class HyperVVMBusRing {
+  uint8_t  *_data   = nullptr;
+  uint8_t  *_mirror = nullptr;
+  uint32_t _size    = kRingSize;
+
+public:
+  typedef SyncPolicy Sync;
+
+  static inline uint32_t alignPacketLength(uint32_t length) {
+    return (length + (sizeof (uint64_t) - 1)) & ~((uint32_t) sizeof (uint64_t) - 1);
+  }
+  static inline uint32_t getPacketRingLength(uint32_t length) {
+    return alignPacketLength(length) + sizeof (uint64_t);
+  }
+
+  inline void init(uint8_t *data, uint32_t size, uint8_t *mirror = nullptr) {
+    _data   = data;
+    _mirror = mirror;
+    _size   = kRingSize != 0 ? kRingSize : size;
+  }
+  inline void reset() {
+    _data   = nullptr;
+    _mirror = nullptr;
+    _size   = kRingSize;
+  }
+
+  inline uint32_t getSize() const {
+    return kRingSize != 0 ? kRingSize : _size;
+  }
+  inline uint8_t *getData() const {
+    return _data;
+  }
+  inline bool isMirrored() const {
+    return _mirror != nullptr;
+  }
+
+  //
+  // Gets bytes available for reading and writing between the specified indexes.
+  //
+  inline void getAvailableSpace(uint32_t readIndex, uint32_t writeIndex, uint32_t *readBytes, uint32_t *writeBytes) const {
+    uint32_t size = getSize();
+
+    *writeBytes = (writeIndex >= readIndex) ? (size - (writeIndex - readIndex)) : (readIndex - writeIndex);
+    *readBytes  = size - *writeBytes;
+  }
+
+  inline uint32_t advanceIndex(uint32_t index, uint32_t length) const {
+    index += length;
+    if (index >= getSize()) {
+      index -= getSize();
+    }
+    return index;
+  }
+
+  //
+  // Gets a linear pointer to data at the specified index if possible, otherwise NULL.
+  //
+  inline uint8_t *getLinearPointer(uint32_t index, uint32_t length) const {
+    if (_mirror != nullptr) {
+      return &_mirror[index];
+    }
+    return (length <= getSize() - index) ? &_data[index] : nullptr;
+  }
+
+  //
+  // Copy helpers, handling wraparound if the ring is not mirrored.
+  //
+  inline uint32_t copyFrom(uint32_t index, void *out, uint32_t length) const {
+    uint32_t size = getSize();
+
+    if (_mirror != nullptr) {
+      memcpy(out, &_mirror[index], length);
+    } else if (length > size - index) {
+      uint32_t fragmentLength = size - index;
+      memcpy(out, &_data[index], fragmentLength);
+      memcpy((uint8_t*) out + fragmentLength, _data, length - fragmentLength);
+    } else {
+      memcpy(out, &_data[index], length);
+    }
+    return advanceIndex(index, length);
+  }
+
+  inline uint32_t copyTo(uint32_t index, const void *in, uint32_t length) {
+    uint32_t size = getSize();
+
+    if (_mirror != nullptr) {
+      memcpy(&_mirror[index], in, length);
+    } else if (length > size - index) {
+      uint32_t fragmentLength = size - index;
+      memcpy(&_data[index], in, fragmentLength);
+      memcpy(_data, (const uint8_t*) in + fragmentLength, length - fragmentLength);
+    } else {
+      memcpy(&_data[index], in, length);
+    }
+    return advanceIndex(index, length);
+  }
+
+  inline uint32_t zero(uint32_t index, uint32_t length) {
+    uint32_t size = getSize();
+
+    if (_mirror != nullptr) {
+      memset(&_mirror[index], 0, length);
+    } else if (length > size - index) {
+      uint32_t fragmentLength = size - index;
+      memset(&_data[index], 0, fragmentLength);
+      memset(_data, 0, length - fragmentLength);
+    } else {
+      memset(&_data[index], 0, length);
+    }
+    return advanceIndex(index, length);
+  }
+
+  //
+  // Checks if a packet of the specified length and its trailing index fit in the available space.
+  // The ring can never become completely full, as that would be indistinguishable from an empty ring.
+  //
+  inline bool canWritePacket(uint32_t readIndex, uint32_t writeIndex, uint32_t length, uint32_t reservedBytes = 0) const {
+    uint32_t readBytes;
+    uint32_t writeBytes;
+
+    getAvailableSpace(readIndex, writeIndex, &readBytes, &writeBytes);
+    return writeBytes > getPacketRingLength(length) + reservedBytes;
+  }
+
+  //
+  // Writes a packet made of the specified fragments, followed by padding and the trailing index.
+  // Space must have already been checked by the caller. Returns the new write index.
+  //
+  inline uint32_t writePacket(uint32_t writeIndex, const HyperVVMBusRingFragment *fragments, uint32_t fragmentCount) {
+    uint32_t length            = 0;
+    uint32_t writeIndexNew     = writeIndex;
+    uint64_t writeIndexTrailer = ((uint64_t) writeIndex) << 32;
+
+    for (uint32_t i = 0; i < fragmentCount; i++) {
+      if (fragments[i].data != nullptr) {
+        writeIndexNew = copyTo(writeIndexNew, fragments[i].data, fragments[i].length);
+      } else {
+        writeIndexNew = zero(writeIndexNew, fragments[i].length);
+      }
+      length += fragments[i].length;
+    }
+    writeIndexNew = zero(writeIndexNew, alignPacketLength(length) - length);
+    return copyTo(writeIndexNew, &writeIndexTrailer, sizeof (writeIndexTrailer));
+  }
+
+  //
+  // Skips over a packet and its trailing index. Returns the new read index.
+  //
+  inline uint32_t skipPacket(uint32_t readIndex, uint32_t length) const {
+    return advanceIndex(readIndex, length + sizeof (uint64_t));
+  }
+};
+
+#endif
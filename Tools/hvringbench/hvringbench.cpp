@@ -0,0 +1,422 @@
+//
+//  hvringbench.cpp
+//  Hyper-V VMBus ring buffer microbenchmark
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+//  Exercises the ring buffer core shared with the kext on an ordinary Linux machine.
+//
+
+#include "HyperVVMBusRing.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kRingBenchDefaultPacketCount  2000000
+#define kRingBenchLargeRingSize       (256 * 1024)
+#define kRingBenchSmallRingSize       (8 * 1024)
+#define kRingBenchMaxPayloadSize      4096
+#define kRingBenchSpinCount           1024
+
+//
+// Mirrors the VMBus packet header layout.
+//
+typedef struct __attribute__((packed)) {
+  uint16_t type;
+  uint16_t headerLength;
+  uint16_t totalLength;
+  uint16_t flags;
+  uint64_t transactionId;
+} RingBenchPacketHeader;
+
+//
+// Mirrors the read and write index portion of the VMBus ring buffer header.
+//
+typedef struct {
+  volatile uint32_t writeIndex;
+  volatile uint32_t readIndex;
+} RingBenchControl;
+
+typedef struct {
+  uint8_t  *data;
+  uint32_t size;
+  bool     isMirrored;
+  int      fd;
+} RingBenchMemory;
+
+typedef struct {
+  const char *name;
+  uint32_t   minPayload;
+  uint32_t   maxPayload;
+} RingBenchSizeMix;
+
+typedef struct {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t errors;
+  double   seconds;
+} RingBenchResult;
+
+//
+// Mixed sizes roughly follow network traffic, with a large share of small control packets.
+// Wrap-heavy sizes are odd and large relative to the small ring, so most packets straddle the end of the ring.
+//
+static const RingBenchSizeMix kMixedSizes    = { "mixed",      16,   1514 };
+static const RingBenchSizeMix kWrapHeavySizes = { "wrap-heavy", 1000, 3000 };
+
+static uint8_t payloadSource[kRingBenchMaxPayloadSize];
+
+static inline uint32_t nextRandom(uint32_t *state) {
+  *state = (*state * 1664525) + 1013904223;
+  return *state >> 8;
+}
+
+static inline uint32_t getPayloadLength(const RingBenchSizeMix *mix, uint32_t *state) {
+  uint32_t value = nextRandom(state);
+
+  //
+  // Half of mixed packets are small control-sized packets.
+  //
+  if (mix == &kMixedSizes && (value & 1)) {
+    return mix->minPayload + (value % 112);
+  }
+  return mix->minPayload + (value % (mix->maxPayload - mix->minPayload + 1));
+}
+
+static double getTimeSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static inline void spinWait(uint32_t *spins) {
+  if (++(*spins) >= kRingBenchSpinCount) {
+    *spins = 0;
+    sched_yield();
+  } else {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+}
+
+//
+// Allocates ring memory, optionally mapped twice back-to-back like the kext does.
+//
+static bool allocRingMemory(RingBenchMemory *memory, uint32_t size, bool mirror) {
+  memory->size       = size;
+  memory->isMirrored = false;
+  memory->fd         = -1;
+
+  if (!mirror) {
+    memory->data = (uint8_t*) aligned_alloc(4096, size);
+    return memory->data != nullptr;
+  }
+
+  memory->fd = memfd_create("hvringbench", 0);
+  if (memory->fd < 0 || ftruncate(memory->fd, size) != 0) {
+    fprintf(stderr, "hvringbench: failed to create ring memory: %s\n", strerror(errno));
+    return false;
+  }
+
+  void *base = mmap(nullptr, size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory->fd, 0) == MAP_FAILED
+      || mmap((uint8_t*) base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memory->fd, 0) == MAP_FAILED) {
+    fprintf(stderr, "hvringbench: failed to map ring mirror: %s\n", strerror(errno));
+    munmap(base, size * 2);
+    return false;
+  }
+
+  memory->data       = (uint8_t*) base;
+  memory->isMirrored = true;
+  return true;
+}
+
+static void freeRingMemory(RingBenchMemory *memory) {
+  if (memory->isMirrored) {
+    munmap(memory->data, memory->size * 2);
+    close(memory->fd);
+  } else {
+    free(memory->data);
+  }
+}
+
+//
+// Producer and consumer halves, following the same framing and index protocol as the kext and Hyper-V.
+//
+template <class Ring>
+static bool producePacket(Ring *ring, RingBenchControl *control, uint32_t *writeIndex, uint64_t transactionId, uint32_t payloadLength) {
+  RingBenchPacketHeader   header;
+  HyperVVMBusRingFragment fragments[2];
+  uint32_t                totalLength = sizeof (header) + payloadLength;
+  uint32_t                readIndex;
+
+  readIndex = Ring::Sync::loadIndex(&control->readIndex);
+  if (!ring->canWritePacket(readIndex, *writeIndex, totalLength)) {
+    return false;
+  }
+
+  header.type          = 6;
+  header.flags         = 0;
+  header.transactionId = transactionId;
+  header.headerLength  = sizeof (header) >> 3;
+  header.totalLength   = Ring::alignPacketLength(totalLength) >> 3;
+
+  fragments[0].data   = &header;
+  fragments[0].length = sizeof (header);
+  fragments[1].data   = &payloadSource[transactionId & 0xFF];
+  fragments[1].length = payloadLength;
+
+  *writeIndex = ring->writePacket(*writeIndex, fragments, 2);
+  return true;
+}
+
+template <class Ring>
+static bool consumePacket(Ring *ring, uint32_t *readIndex, uint32_t writeIndex, uint8_t *bounce, RingBenchResult *result) {
+  RingBenchPacketHeader header;
+  uint8_t               *packet;
+  uint32_t              totalLength;
+
+  if (*readIndex == writeIndex) {
+    return false;
+  }
+
+  //
+  // Access the packet in place if possible, otherwise copy it out like the kext does for wrapped packets.
+  //
+  ring->copyFrom(*readIndex, &header, sizeof (header));
+  totalLength = header.totalLength << 3;
+  packet = ring->getLinearPointer(*readIndex, totalLength);
+  if (packet == nullptr) {
+    ring->copyFrom(*readIndex, bounce, totalLength);
+    packet = bounce;
+  }
+
+  if (header.transactionId != result->packets
+      || packet[sizeof (header)] != payloadSource[header.transactionId & 0xFF]) {
+    result->errors++;
+  }
+
+  *readIndex = ring->skipPacket(*readIndex, totalLength);
+  result->packets++;
+  result->bytes += totalLength;
+  return true;
+}
+
+//
+// Single threaded, alternating between filling and draining the ring.
+//
+template <class Ring>
+static void runLockstep(Ring *ring, const RingBenchSizeMix *mix, uint64_t packetCount, RingBenchResult *result) {
+  RingBenchControl control      = { 0, 0 };
+  uint32_t         writeIndex   = 0;
+  uint32_t         readIndex    = 0;
+  uint32_t         random       = 1;
+  uint32_t         nextLength   = getPayloadLength(mix, &random);
+  uint64_t         transaction  = 0;
+  uint8_t          *bounce      = (uint8_t*) malloc(ring->getSize());
+  double           start;
+
+  *result = { };
+  start = getTimeSeconds();
+  while (result->packets < packetCount) {
+    while (transaction < packetCount && producePacket(ring, &control, &writeIndex, transaction, nextLength)) {
+      transaction++;
+      nextLength = getPayloadLength(mix, &random);
+    }
+    Ring::Sync::storeIndex(&control.writeIndex, writeIndex);
+
+    while (consumePacket(ring, &readIndex, Ring::Sync::loadIndex(&control.writeIndex), bounce, result));
+    Ring::Sync::storeIndex(&control.readIndex, readIndex);
+  }
+  result->seconds = getTimeSeconds() - start;
+  free(bounce);
+}
+
+//
+// Producer and consumer on separate threads, pinned to separate cores if available.
+//
+template <class Ring>
+struct RingBenchThreadContext {
+  Ring                   *ring;
+  RingBenchControl       control;
+  const RingBenchSizeMix *mix;
+  uint64_t               packetCount;
+  int                    cpu;
+};
+
+static void pinThread(int cpu) {
+  cpu_set_t set;
+
+  if (cpu < 0 || cpu >= sysconf(_SC_NPROCESSORS_ONLN)) {
+    return;
+  }
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof (set), &set);
+}
+
+template <class Ring>
+static void *producerThread(void *arg) {
+  RingBenchThreadContext<Ring> *context = (RingBenchThreadContext<Ring>*) arg;
+  uint32_t writeIndex = 0;
+  uint32_t random     = 1;
+  uint32_t spins      = 0;
+  uint32_t length     = getPayloadLength(context->mix, &random);
+
+  pinThread(context->cpu);
+  for (uint64_t transaction = 0; transaction < context->packetCount; ) {
+    if (producePacket(context->ring, &context->control, &writeIndex, transaction, length)) {
+      transaction++;
+      length = getPayloadLength(context->mix, &random);
+
+      //
+      // Publish after every packet, as the kext does outside of TX batches.
+      //
+      Ring::Sync::storeIndex(&context->control.writeIndex, writeIndex);
+    } else {
+      spinWait(&spins);
+    }
+  }
+  return nullptr;
+}
+
+template <class Ring>
+static void runThreaded(Ring *ring, const RingBenchSizeMix *mix, uint64_t packetCount, RingBenchResult *result) {
+  RingBenchThreadContext<Ring> context;
+  pthread_t                    producer;
+  uint32_t                     readIndex = 0;
+  uint32_t                     spins     = 0;
+  uint8_t                      *bounce   = (uint8_t*) malloc(ring->getSize());
+  double                       start;
+
+  context.ring               = ring;
+  context.control.writeIndex = 0;
+  context.control.readIndex  = 0;
+  context.mix                = mix;
+  context.packetCount        = packetCount;
+  context.cpu                = 1;
+
+  *result = { };
+  pinThread(0);
+  start = getTimeSeconds();
+  pthread_create(&producer, nullptr, producerThread<Ring>, &context);
+
+  //
+  // Consume in batches, publishing the read index once per batch as the kext does.
+  //
+  while (result->packets < packetCount) {
+    uint32_t writeIndex = Ring::Sync::loadIndex(&context.control.writeIndex);
+    if (readIndex == writeIndex) {
+      spinWait(&spins);
+      continue;
+    }
+    while (consumePacket(ring, &readIndex, writeIndex, bounce, result));
+    Ring::Sync::storeIndex(&context.control.readIndex, readIndex);
+  }
+
+  pthread_join(producer, nullptr);
+  result->seconds = getTimeSeconds() - start;
+  free(bounce);
+}
+
+static void printResult(const char *scenario, const char *policy, const RingBenchSizeMix *mix, bool mirrored,
+                        uint32_t ringSize, const RingBenchResult *result) {
+  printf("%-10s %-8s %-10s %-8s %7u KB %10llu %8.3f %10.2f %10.1f %6llu\n", scenario, policy, mix->name,
+         mirrored ? "mirror" : "wrap", ringSize / 1024, (unsigned long long) result->packets, result->seconds,
+         result->packets / result->seconds / 1e6, result->bytes / result->seconds / (1024 * 1024),
+         (unsigned long long) result->errors);
+}
+
+template <uint32_t kRingSize, class SyncPolicy>
+static bool runScenario(const char *scenario, const char *policy, const RingBenchSizeMix *mix, uint32_t ringSize,
+                        bool mirror, bool threaded, uint64_t packetCount) {
+  HyperVVMBusRing<kRingSize, SyncPolicy> ring;
+  RingBenchMemory                        memory;
+  RingBenchResult                        result;
+
+  if (!allocRingMemory(&memory, ringSize, mirror)) {
+    printf("%-10s %-8s %-10s %-8s %7u KB (mirror unavailable)\n", scenario, policy, mix->name, "mirror", ringSize / 1024);
+    return true;
+  }
+  ring.init(memory.data, ringSize, memory.isMirrored ? memory.data : nullptr);
+
+  if (threaded) {
+    runThreaded(&ring, mix, packetCount, &result);
+  } else {
+    runLockstep(&ring, mix, packetCount, &result);
+  }
+  printResult(scenario, policy, mix, memory.isMirrored, ringSize, &result);
+
+  freeRingMemory(&memory);
+  return result.errors == 0 && result.packets == packetCount;
+}
+
+int main(int argc, const char *argv[]) {
+  uint64_t packetCount = kRingBenchDefaultPacketCount;
+  bool     success     = true;
+
+  if (argc > 1) {
+    packetCount = strtoull(argv[1], nullptr, 0);
+    if (packetCount == 0) {
+      fprintf(stderr, "usage: %s [packet count]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  for (uint32_t i = 0; i < sizeof (payloadSource); i++) {
+    payloadSource[i] = (uint8_t) (i * 31 + 7);
+  }
+
+  printf("hvringbench: %llu packets per run, %ld CPUs online\n", (unsigned long long) packetCount, sysconf(_SC_NPROCESSORS_ONLN));
+  printf("%-10s %-8s %-10s %-8s %10s %10s %8s %10s %10s %6s\n", "scenario", "sync", "sizes", "layout", "ring",
+         "packets", "seconds", "Mpkt/s", "MB/s", "errors");
+
+  //
+  // Single threaded, measures framing and copy cost without cross-core traffic.
+  // Fixed size rings allow the compiler to fold the ring size, dynamic rings match the kext.
+  //
+  success &= runScenario<kRingBenchLargeRingSize, HyperVVMBusRingNoSync>("lockstep", "none", &kMixedSizes,
+                                                                          kRingBenchLargeRingSize, false, false, packetCount);
+  success &= runScenario<0, HyperVVMBusRingNoSync>("lockstep", "none", &kMixedSizes,
+                                                   kRingBenchLargeRingSize, false, false, packetCount);
+  success &= runScenario<0, HyperVVMBusRingFullBarrierSync>("lockstep", "full", &kMixedSizes,
+                                                            kRingBenchLargeRingSize, false, false, packetCount);
+
+  //
+  // Wrap-heavy, compares split copies and bounce buffering against mirrored rings.
+  //
+  success &= runScenario<kRingBenchSmallRingSize, HyperVVMBusRingNoSync>("lockstep", "none", &kWrapHeavySizes,
+                                                                          kRingBenchSmallRingSize, false, false, packetCount);
+  success &= runScenario<kRingBenchSmallRingSize, HyperVVMBusRingNoSync>("lockstep", "none", &kWrapHeavySizes,
+                                                                          kRingBenchSmallRingSize, true, false, packetCount);
+
+  //
+  // Producer and consumer on two cores.
+  //
+  success &= runScenario<0, HyperVVMBusRingFullBarrierSync>("threaded", "full", &kMixedSizes,
+                                                            kRingBenchLargeRingSize, false, true, packetCount);
+  success &= runScenario<0, HyperVVMBusRingAcquireReleaseSync>("threaded", "acq-rel", &kMixedSizes,
+                                                               kRingBenchLargeRingSize, false, true, packetCount);
+  success &= runScenario<0, HyperVVMBusRingFullBarrierSync>("threaded", "full", &kMixedSizes,
+                                                            kRingBenchLargeRingSize, true, true, packetCount);
+  success &= runScenario<0, HyperVVMBusRingFullBarrierSync>("threaded", "full", &kWrapHeavySizes,
+                                                            kRingBenchSmallRingSize, false, true, packetCount);
+  success &= runScenario<0, HyperVVMBusRingFullBarrierSync>("threaded", "full", &kWrapHeavySizes,
+                                                            kRingBenchSmallRingSize, true, true, packetCount);
+
+  if (!success) {
+    fprintf(stderr, "hvringbench: packet verification failed\n");
+    return 1;
+  }
+  return 0;
+}
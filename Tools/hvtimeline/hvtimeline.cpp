@@ -0,0 +1,223 @@
+//
+//  hvtimeline.cpp
+//  Hyper-V boot timeline decoder
+//
+//  Copyright © 2022 Goldfish64. All rights reserved.
+//
+//  Decodes the HVBootTimeline property published by HyperVController on an ordinary Linux machine.
+//  Input may be the raw property bytes, or hex text as printed by ioreg.
+//
+
+#include "HyperVTimeline.hpp"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define kTimelineTicksPerMillisecond  10000.0
+
+static const char *eventName(uint8_t event) {
+  switch (event) {
+    case kHyperVTimelineEventBegin:
+      return "begin";
+    case kHyperVTimelineEventEnd:
+      return "end";
+    case kHyperVTimelineEventFailed:
+      return "failed";
+    case kHyperVTimelineEventInstant:
+      return "instant";
+    default:
+      return "unknown";
+  }
+}
+
+static int hexValue(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c = tolower(c);
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+//
+// Hex text is used if the input is made up of hex digits, whitespace, comment lines, and ioreg angle brackets.
+// Anything else is treated as raw property bytes.
+//
+static bool decodeInput(const std::string &input, std::vector<uint8_t> &data) {
+  std::string hex;
+  bool        isText    = true;
+  bool        inComment = false;
+
+  for (size_t i = 0; i < input.size() && isText; i++) {
+    char c = input[i];
+    if (inComment) {
+      inComment = c != '\n';
+    } else if (c == '#') {
+      inComment = true;
+    } else if (hexValue(c) >= 0) {
+      hex.push_back(c);
+    } else if (!isspace((unsigned char) c) && c != '<' && c != '>') {
+      isText = false;
+    }
+  }
+
+  if (!isText) {
+    data.assign(input.begin(), input.end());
+    return true;
+  }
+  if (hex.size() % 2 != 0) {
+    fprintf(stderr, "Hex input has an odd number of digits\n");
+    return false;
+  }
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    data.push_back((uint8_t) ((hexValue(hex[i]) << 4) | hexValue(hex[i + 1])));
+  }
+  return true;
+}
+
+static bool readFile(const char *path, std::string &contents) {
+  FILE   *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  char   buffer[4096];
+  size_t length;
+
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+  while ((length = fread(buffer, 1, sizeof (buffer), file)) > 0) {
+    contents.append(buffer, length);
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+  return true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-l limit-ms] <file|->\n", name);
+  fprintf(stderr, "  -l  Fail if the last device is ready later than limit-ms after the controller starts\n");
+}
+
+int main(int argc, char **argv) {
+  std::string                       input;
+  std::vector<uint8_t>              data;
+  std::vector<HyperVTimelineRecord> records;
+  HyperVTimelineHeader              header;
+  const char                        *path   = nullptr;
+  double                            limitMs = -1.0;
+  uint64_t                          base    = 0;
+  uint64_t                          ready   = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      limitMs = atof(argv[++i]);
+    } else if (path == nullptr) {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (path == nullptr) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (!readFile(path, input) || !decodeInput(input, data)) {
+    return 2;
+  }
+
+  //
+  // Validate header and copy out records.
+  //
+  if (data.size() < sizeof (header)) {
+    fprintf(stderr, "Timeline is too short (%zu bytes)\n", data.size());
+    return 2;
+  }
+  memcpy(&header, data.data(), sizeof (header));
+  if (header.magic != kHyperVTimelineMagic || header.version != kHyperVTimelineVersion
+      || header.recordSize != sizeof (HyperVTimelineRecord)) {
+    fprintf(stderr, "Unsupported timeline (magic 0x%X, version %u, record size %u)\n",
+            header.magic, header.version, header.recordSize);
+    return 2;
+  }
+  if (data.size() < sizeof (header) + ((size_t) header.recordCount * sizeof (HyperVTimelineRecord))) {
+    fprintf(stderr, "Timeline is truncated, expected %u records\n", header.recordCount);
+    return 2;
+  }
+
+  records.resize(header.recordCount);
+  if (header.recordCount > 0) {
+    memcpy(records.data(), data.data() + sizeof (header), header.recordCount * sizeof (HyperVTimelineRecord));
+  }
+
+  //
+  // Records from different CPUs may be slightly out of order, records not yet written have no timestamp.
+  //
+  records.erase(std::remove_if(records.begin(), records.end(),
+                               [](const HyperVTimelineRecord &record) { return record.timestamp == 0; }), records.end());
+  std::stable_sort(records.begin(), records.end(), [](const HyperVTimelineRecord &a, const HyperVTimelineRecord &b) {
+    return a.timestamp < b.timestamp;
+  });
+
+  for (const HyperVTimelineRecord &record : records) {
+    if (record.channelId == 0 && record.phase == kHyperVTimelinePhaseControllerStart && record.event == kHyperVTimelineEventBegin) {
+      base = record.timestamp;
+      break;
+    }
+  }
+  if (base == 0 && !records.empty()) {
+    base = records[0].timestamp;
+  }
+
+  printf("%u records, %u dropped\n\n", header.recordCount, header.droppedCount);
+  printf("%12s  %7s  %3s  %-18s  %s\n", "Time (ms)", "Channel", "CPU", "Phase", "Event");
+  for (const HyperVTimelineRecord &record : records) {
+    printf("%12.3f  %7u  %3u  %-18s  %s\n", (record.timestamp - base) / kTimelineTicksPerMillisecond,
+           record.channelId, record.cpu, HyperVTimelinePhaseName(record.phase), eventName(record.event));
+  }
+
+  //
+  // Pair begin and end records into phase durations.
+  //
+  printf("\n%12s  %12s  %7s  %-18s  %s\n", "Start (ms)", "Length (ms)", "Channel", "Phase", "Result");
+  for (size_t i = 0; i < records.size(); i++) {
+    if (records[i].event != kHyperVTimelineEventBegin) {
+      continue;
+    }
+    for (size_t j = i + 1; j < records.size(); j++) {
+      if (records[j].channelId == records[i].channelId && records[j].phase == records[i].phase
+          && (records[j].event == kHyperVTimelineEventEnd || records[j].event == kHyperVTimelineEventFailed)) {
+        printf("%12.3f  %12.3f  %7u  %-18s  %s\n", (records[i].timestamp - base) / kTimelineTicksPerMillisecond,
+               (records[j].timestamp - records[i].timestamp) / kTimelineTicksPerMillisecond, records[i].channelId,
+               HyperVTimelinePhaseName(records[i].phase), records[j].event == kHyperVTimelineEventEnd ? "ok" : "failed");
+        break;
+      }
+    }
+  }
+
+  for (const HyperVTimelineRecord &record : records) {
+    if (record.phase == kHyperVTimelinePhaseDeviceReady) {
+      ready = record.timestamp;
+    }
+  }
+  if (ready == 0) {
+    printf("\nNo devices reported ready\n");
+    return limitMs >= 0.0 ? 1 : 0;
+  }
+
+  printf("\nLast device ready at %.3f ms\n", (ready - base) / kTimelineTicksPerMillisecond);
+  if (limitMs >= 0.0 && (ready - base) / kTimelineTicksPerMillisecond > limitMs) {
+    printf("Exceeds limit of %.3f ms\n", limitMs);
+    return 1;
+  }
+  return 0;
+}